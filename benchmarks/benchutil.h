@@ -0,0 +1,81 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+// Helpers shared by the benchmarks
+
+#include "connection.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QtGlobal>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace QMatrixClient
+{
+    namespace Bench
+    {
+        /** The peak resident set size of the process in KiB, -1 if unknown */
+        inline qint64 peakRssKb()
+        {
+#ifdef Q_OS_UNIX
+            rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) == 0)
+            {
+#ifdef Q_OS_MAC
+                return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+                return usage.ru_maxrss;
+#endif
+            }
+#endif
+            return -1;
+        }
+
+        /** The current resident set size in KiB; -1 if unknown (non-Linux) */
+        inline qint64 currentRssKb()
+        {
+#ifdef Q_OS_LINUX
+            QFile statm { "/proc/self/statm" };
+            if (statm.open(QFile::ReadOnly))
+            {
+                const auto fields = statm.readAll().split(' ');
+                if (fields.size() > 1)
+                    return fields[1].toLongLong() * sysconf(_SC_PAGESIZE) / 1024;
+            }
+#endif
+            return -1;
+        }
+
+        /**
+         * Sets up the connection as if the user has logged in, without
+         * any network access; caching is turned off so that benchmarks
+         * don't write anything unless they enable it explicitly
+         */
+        inline void connectOffline(Connection& c)
+        {
+            c.setCacheState(false);
+            c.setCacheTimeline(false);
+            c.connectWithToken("@bench:example.org", "token", "BENCH");
+        }
+    }
+}  // namespace QMatrixClient
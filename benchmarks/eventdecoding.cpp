@@ -0,0 +1,153 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures constructing room message events from JSON with their content
+// decoded lazily: the time to construct the events, the time to access
+// the content of all of them afterwards, and the memory taken per event
+// in each state. The JSON objects are parsed upfront and shared with
+// the events, as the events of a /sync response share its document; so
+// the memory figures don't include the original JSON.
+// Usage:
+//   qmc-bench-eventdecoding [events [iterations]]
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "events/roommessageevent.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace QMatrixClient;
+using Bench::makeEventJson;
+using std::cout;
+using std::endl;
+
+// Mostly plain text messages, with some HTML-formatted ones and images
+QJsonObject makeMessageJson(int n)
+{
+    QJsonObject content;
+    content.insert("body",
+        QStringLiteral("Message %1, long enough to look like a real one")
+            .arg(n));
+    if (n % 10 == 9)
+    {
+        content.insert("msgtype", QStringLiteral("m.image"));
+        content.insert("url",
+                       QStringLiteral("mxc://example.org/image%1").arg(n));
+        QJsonObject info;
+        info.insert("mimetype", QStringLiteral("image/png"));
+        info.insert("size", 100000 + n);
+        info.insert("w", 640);
+        info.insert("h", 480);
+        content.insert("info", info);
+    }
+    else
+    {
+        content.insert("msgtype", QStringLiteral("m.text"));
+        if (n % 5 == 4)
+        {
+            content.insert("format", QStringLiteral("org.matrix.custom.html"));
+            content.insert("formatted_body",
+                QStringLiteral("<b>Message</b> %1").arg(n));
+        }
+    }
+    return makeEventJson("m.room.message",
+                         QStringLiteral("@user%1:example.org").arg(n % 50),
+                         n, content);
+}
+
+struct Result
+{
+    qint64 constructMs = 0;
+    qint64 decodeMs = 0;
+    qint64 constructedKb = 0;
+    qint64 decodedKb = 0;
+};
+
+Result runOnce(const std::vector<QJsonObject>& jsons)
+{
+    Result r;
+    std::vector<std::unique_ptr<RoomMessageEvent>> events;
+    events.reserve(jsons.size());
+    const auto rssBefore = Bench::currentRssKb();
+    QElapsedTimer et; et.start();
+    for (const auto& json: jsons)
+        events.emplace_back(new RoomMessageEvent(json));
+    r.constructMs = et.restart();
+    r.constructedKb = Bench::currentRssKb() - rssBefore;
+
+    int bodyLengths = 0;
+    for (const auto& e: events)
+    {
+        bodyLengths += e->plainBody().size();
+        if (e->content() && e->timestamp().isValid())
+            ++bodyLengths;
+    }
+    r.decodeMs = et.elapsed();
+    r.decodedKb = Bench::currentRssKb() - rssBefore;
+    if (bodyLengths == 0)
+        r.decodeMs = -1;
+    return r;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int count = args.size() > 0 ? args[0].toInt() : 100000;
+    const int iterations = args.size() > 1 ? args[1].toInt() : 3;
+    if (count <= 0 || iterations <= 0)
+    {
+        cout << "Usage: qmc-bench-eventdecoding [events [iterations]]" << endl;
+        return 2;
+    }
+
+    std::vector<QJsonObject> jsons;
+    jsons.reserve(size_t(count));
+    for (int n = 0; n < count; ++n)
+        jsons.push_back(makeMessageJson(n));
+
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto r = runOnce(jsons);
+        if (r.decodeMs < 0)
+        {
+            cout << "Events have no content" << endl;
+            return 1;
+        }
+        // Freed memory is reused by the next iterations, so only the first
+        // one shows meaningful memory figures
+        cout << "Iteration " << i + 1 << ": constructing " << r.constructMs
+             << " ms; accessing content " << r.decodeMs << " ms";
+        if (i == 0)
+            cout << "; memory per event " << r.constructedKb * 1024 / count
+                 << " bytes constructed, " << r.decodedKb * 1024 / count
+                 << " bytes decoded";
+        cout << endl;
+    }
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
@@ -0,0 +1,158 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Compares EventIdIndex with QHash<QString, int> at the operations Room
+// performs on its event id index: inserting ids of new events, looking up
+// ids of known events (receipts, findInTimeline()) and checking ids that
+// are not in the timeline (dropDuplicateEvents() on a fresh batch).
+// The ids are shared with the "timeline", as in Room, so the memory
+// numbers only show the index overhead.
+// Usage:
+//   qmc-bench-eventidindex [events...]
+
+#include "benchutil.h"
+
+#include "eventidindex.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+
+#include <iostream>
+#include <vector>
+
+using namespace QMatrixClient;
+using std::cout;
+using std::endl;
+
+// Event ids look like $<18 random characters>:<server>
+std::vector<QString> makeEventIds(int count, int seed)
+{
+    static const char Chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::vector<QString> ids;
+    ids.reserve(size_t(count));
+    quint32 state = quint32(seed) * 2654435761u + 1;
+    for (int i = 0; i < count; ++i)
+    {
+        QString id { '$' };
+        for (int c = 0; c < 18; ++c)
+        {
+            state = state * 1664525u + 1013904223u;
+            id += QLatin1Char(Chars[(state >> 16) % (sizeof(Chars) - 1)]);
+        }
+        ids.push_back(id + QStringLiteral(":example.org"));
+    }
+    return ids;
+}
+
+struct Timings
+{
+    qint64 insertMs = 0;
+    qint64 hitMs = 0;
+    qint64 missMs = 0;
+    qint64 memoryKb = 0;
+    qint64 checksum = 0;
+};
+
+template <typename IndexT, typename FindT>
+Timings bench(IndexT& index, const std::vector<QString>& ids,
+              const std::vector<QString>& newIds, FindT find)
+{
+    Timings t;
+    const auto rssBefore = Bench::currentRssKb();
+    QElapsedTimer et; et.start();
+    for (size_t i = 0; i < ids.size(); ++i)
+        index.insert(ids[i], int(i));
+    t.insertMs = et.restart();
+    t.memoryKb = Bench::currentRssKb() - rssBefore;
+    for (const auto& id: ids)
+        t.checksum += find(index, id);
+    t.hitMs = et.restart();
+    for (const auto& id: newIds)
+        t.checksum += find(index, id);
+    t.missMs = et.elapsed();
+    return t;
+}
+
+void printTimings(const char* name, const Timings& t)
+{
+    cout << "  " << name << ": insert " << t.insertMs << " ms, lookup "
+         << t.hitMs << " ms, lookup of new ids " << t.missMs << " ms, ~"
+         << t.memoryKb << " KiB" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+    if (args.isEmpty())
+        args << "10000" << "100000" << "1000000";
+
+    for (const auto& arg: args)
+    {
+        const auto count = arg.toInt();
+        if (count <= 0)
+        {
+            cout << "Usage: qmc-bench-eventidindex [events...]" << endl;
+            return 2;
+        }
+        const auto ids = makeEventIds(count, 1);
+        const auto newIds = makeEventIds(count, 2);
+
+        // Misses are counted as -1 in both cases, so the checksums match
+        // if the two indices agree. EventIdIndex goes first: its table is
+        // a single block returned to the system when freed, while the nodes
+        // of QHash tend to stay in the heap and skew the next measurement.
+        Timings indexTimings;
+        int indexSize = 0;
+        {
+            EventIdIndex index {
+                [&ids] (EventIdIndex::index_t i) -> const QString&
+                {
+                    return ids[size_t(i)];
+                }
+            };
+            indexTimings = bench(index, ids, newIds,
+                [] (const EventIdIndex& idx, const QString& id)
+                {
+                    const auto i = idx.find(id);
+                    return i == EventIdIndex::NoIndex ? -1 : i;
+                });
+            indexSize = index.size();
+        }
+        QHash<QString, int> hash;
+        const auto hashTimings = bench(hash, ids, newIds,
+            [] (const QHash<QString, int>& h, const QString& id)
+            {
+                return h.value(id, -1);
+            });
+        if (indexSize != count || indexTimings.checksum != hashTimings.checksum)
+        {
+            cout << "EventIdIndex and QHash disagree at " << count
+                 << " event(s)" << endl;
+            return 1;
+        }
+        cout << count << " event(s):" << endl;
+        printTimings("QHash<QString, int>", hashTimings);
+        printTimings("EventIdIndex", indexTimings);
+    }
+    return 0;
+}
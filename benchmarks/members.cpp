@@ -0,0 +1,157 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures membership processing in a big room: state events with joins
+// of many members (with pairs of namesakes to disambiguate), renames and
+// leaves of a tenth of them, and disambiguated name lookups for everyone.
+// Exits with a non-zero code if the room ends up with a wrong member count.
+// Usage:
+//   qmc-bench-members [members [iterations]]
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "connection.h"
+#include "room.h"
+#include "jobs/syncjob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+
+#include <iostream>
+
+using namespace QMatrixClient;
+using Bench::connectOffline;
+using Bench::makeEventJson;
+using std::cout;
+using std::endl;
+
+QString memberId(int m)
+{
+    return QStringLiteral("@user%1:example.org").arg(m);
+}
+
+// Every member event gets a unique event id through eventNo
+QJsonObject makeMemberEvent(int m, const QString& membership,
+                            const QString& displayName, int eventNo)
+{
+    QJsonObject content;
+    content.insert("membership", membership);
+    if (!displayName.isEmpty())
+        content.insert("displayname", displayName);
+    return makeEventJson("m.room.member", memberId(m), eventNo, content,
+                         memberId(m));
+}
+
+SyncRoomData makeStateUpdate(const QString& roomId, const QJsonArray& events)
+{
+    QJsonObject state;
+    state.insert("events", events);
+    QJsonObject room;
+    room.insert("state", state);
+    return SyncRoomData(roomId, JoinState::Join, room);
+}
+
+struct Timings
+{
+    qint64 joinMs = 0;
+    qint64 renameMs = 0;
+    qint64 lookupMs = 0;
+    qint64 leaveMs = 0;
+};
+
+bool runOnce(int members, Timings& t)
+{
+    Connection c;
+    connectOffline(c);
+    const auto roomId = QStringLiteral("!members:example.org");
+    auto* room = c.provideRoom(roomId, JoinState::Join);
+    const auto changed = members / 10;
+    int eventNo = 0;
+
+    // Members m and m + members/2 share a display name
+    QJsonArray joins;
+    for (int m = 0; m < members; ++m)
+        joins.append(makeMemberEvent(m, "join",
+            QStringLiteral("Member %1").arg(m % (members / 2)), eventNo++));
+    auto joinData = makeStateUpdate(roomId, joins);
+    QElapsedTimer et; et.start();
+    room->updateData(std::move(joinData));
+    t.joinMs += et.elapsed();
+
+    QJsonArray renames;
+    for (int m = 0; m < changed; ++m)
+        renames.append(makeMemberEvent(m, "join",
+            QStringLiteral("Renamed %1").arg(m), eventNo++));
+    auto renameData = makeStateUpdate(roomId, renames);
+    et.restart();
+    room->updateData(std::move(renameData));
+    t.renameMs += et.elapsed();
+
+    et.restart();
+    int nameLengths = 0;
+    for (int m = 0; m < members; ++m)
+        nameLengths += room->roomMembername(memberId(m)).size();
+    t.lookupMs += et.elapsed();
+
+    QJsonArray leaves;
+    for (int m = members - changed; m < members; ++m)
+        leaves.append(makeMemberEvent(m, "leave", {}, eventNo++));
+    auto leaveData = makeStateUpdate(roomId, leaves);
+    et.restart();
+    room->updateData(std::move(leaveData));
+    t.leaveMs += et.elapsed();
+
+    if (room->memberCount() != members - changed || nameLengths == 0)
+    {
+        cout << "The room has " << room->memberCount()
+             << " member(s) instead of " << members - changed << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int members = args.size() > 0 ? args[0].toInt() : 10000;
+    const int iterations = args.size() > 1 ? args[1].toInt() : 5;
+    if (members < 10 || iterations <= 0)
+    {
+        cout << "Usage: qmc-bench-members [members (10 or more) [iterations]]"
+             << endl;
+        return 2;
+    }
+
+    Timings t;
+    for (int i = 0; i < iterations; ++i)
+        if (!runOnce(members, t))
+            return 1;
+    cout << members << " member(s), average of " << iterations
+         << " run(s): join " << t.joinMs / iterations << " ms; rename "
+         << members / 10 << " " << t.renameMs / iterations << " ms; "
+         << "look up all names " << t.lookupMs / iterations << " ms; "
+         << "leave " << members / 10 << " " << t.leaveMs / iterations << " ms"
+         << endl;
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
@@ -0,0 +1,129 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures sorting users by name: with QString::localeAwareCompare() on every
+// comparison (what MemberSorter used to do) vs. comparing the collation keys
+// that User precomputes whenever its name changes. Building the keys is
+// timed separately, as part of setting the names.
+// Usage:
+//   qmc-bench-membersort [users [iterations]]
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "connection.h"
+#include "user.h"
+#include "events/roommemberevent.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+using namespace QMatrixClient;
+using Bench::connectOffline;
+using Bench::makeEventJson;
+using std::cout;
+using std::endl;
+
+QString makeDisplayName(int n)
+{
+    // Every tenth user has no display name and is shown by the id
+    if (n % 10 == 0)
+        return {};
+    static const QStringList names {
+        "Émile", "anna", "Zoë", "Bob", "ÅSA", "olga", "Łukasz", "Chloé",
+        "mike", "Ürsula", "zed", "Ada"
+    };
+    return names[n % names.size()] + ' ' + QString::number(n * 7919 % 100003);
+}
+
+// Without the leading '@', as MemberSorter compared names
+QString sortedName(const User* u)
+{
+    auto name = u->displayname();
+    return name.startsWith('@') ? name.mid(1) : name;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int count = args.size() > 0 ? args[0].toInt() : 50000;
+    const int iterations = args.size() > 1 ? args[1].toInt() : 5;
+    if (count <= 0 || iterations <= 0)
+    {
+        cout << "Usage: qmc-bench-membersort [users [iterations]]" << endl;
+        return 2;
+    }
+
+    Connection c;
+    connectOffline(c);
+    QList<User*> users;
+    users.reserve(count);
+    std::vector<std::unique_ptr<RoomMemberEvent>> events;
+    events.reserve(size_t(count));
+    for (int n = 0; n < count; ++n)
+    {
+        const auto userId = QStringLiteral("@user%1:example.org").arg(n);
+        users.push_back(c.user(userId));
+        QJsonObject content;
+        content.insert("membership", QStringLiteral("join"));
+        const auto displayName = makeDisplayName(n);
+        if (!displayName.isEmpty())
+            content.insert("displayname", displayName);
+        events.emplace_back(new RoomMemberEvent(
+            makeEventJson("m.room.member", userId, n, content, userId)));
+    }
+    QElapsedTimer et; et.start();
+    for (int n = 0; n < count; ++n)
+        users[n]->processEvent(events[size_t(n)].get());
+    cout << count << " user(s) named in " << et.elapsed() << " ms" << endl;
+
+    qint64 compareMs = 0, sortKeyMs = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        auto byCompare = users;
+        et.restart();
+        std::sort(byCompare.begin(), byCompare.end(),
+            [] (const User* u1, const User* u2)
+            {
+                return sortedName(u1).localeAwareCompare(sortedName(u2)) < 0;
+            });
+        compareMs += et.elapsed();
+
+        auto bySortKey = users;
+        et.restart();
+        std::sort(bySortKey.begin(), bySortKey.end(),
+            [] (const User* u1, const User* u2)
+            {
+                return u1->sortKey().compare(u2->sortKey()) < 0;
+            });
+        sortKeyMs += et.elapsed();
+    }
+    cout << "Sorting, average of " << iterations << " run(s): "
+         << "localeAwareCompare() " << compareMs / iterations << " ms; "
+         << "User::sortKey() " << sortKeyMs / iterations << " ms" << endl;
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
@@ -0,0 +1,161 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures request latency with several connections to the same homeserver
+// (a local stub server) sending requests at once, for each way of sharing
+// QNetworkAccessManager between connections. Qt opens at most 6 HTTP
+// connections per host and network access manager, so with more requests
+// in flight than that the scope decides how long they queue.
+// Usage:
+//   qmc-bench-networkscope [connections [requests per connection [rounds]]]
+
+#include "benchutil.h"
+#include "stubserver.h"
+
+#include "connectiondata.h"
+#include "jobs/basejob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEventLoop>
+#include <QtCore/QStringList>
+
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace QMatrixClient;
+using std::cout;
+using std::endl;
+
+class BenchGetJob : public BaseJob
+{
+    public:
+        BenchGetJob()
+            : BaseJob(HttpVerb::Get, "BenchGetJob",
+                      "_matrix/client/r0/account/whoami")
+        { }
+};
+
+struct Result
+{
+    qint64 elapsedMs = 0;
+    qint64 totalLatencyMs = 0;
+    qint64 maxLatencyMs = 0;
+    int succeeded = 0;
+};
+
+Result runRound(const std::vector<std::unique_ptr<ConnectionData>>& conns,
+                int requestsPerConnection)
+{
+    Result result;
+    const int total = int(conns.size()) * requestsPerConnection;
+    int finished = 0;
+    QEventLoop loop;
+    QElapsedTimer et; et.start();
+    for (const auto& c: conns)
+        for (int i = 0; i < requestsPerConnection; ++i)
+        {
+            auto* job = new BenchGetJob;
+            const auto startedAt = et.elapsed();
+            QObject::connect(job, &BaseJob::result,
+                [&,job,startedAt] (BaseJob*) {
+                    const auto latency = et.elapsed() - startedAt;
+                    result.totalLatencyMs += latency;
+                    result.maxLatencyMs = qMax(result.maxLatencyMs, latency);
+                    if (job->status().good())
+                        ++result.succeeded;
+                    if (++finished == total)
+                        loop.quit();
+                });
+            job->start(c.get());
+        }
+    loop.exec();
+    result.elapsedMs = et.elapsed();
+    return result;
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-networkscope "
+            "[connections [requests per connection [rounds]]]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int connections = args.size() > 0 ? args[0].toInt() : 10;
+    const int requests = args.size() > 1 ? args[1].toInt() : 20;
+    const int rounds = args.size() > 2 ? args[2].toInt() : 5;
+    if (connections <= 0 || requests <= 0 || rounds <= 0)
+        return usage();
+
+    Bench::StubServer server { "{\"user_id\":\"@bench:example.org\"}" };
+    if (!server.isListening())
+    {
+        cout << "Couldn't start the stub server: "
+             << server.errorString().toStdString() << endl;
+        return 2;
+    }
+    cout << connections << " connection(s) sending " << requests
+         << " request(s) each to " << server.url().toString().toStdString()
+         << endl;
+
+    using Scope = ConnectionData::NetworkAccessScope;
+    const std::pair<Scope, const char*> scopes[] {
+        { Scope::Global, "Global:        " },
+        { Scope::PerHomeserver, "PerHomeserver: " },
+        { Scope::PerConnection, "PerConnection: " }
+    };
+    for (const auto& scope: scopes)
+    {
+        std::vector<std::unique_ptr<ConnectionData>> conns;
+        for (int i = 0; i < connections; ++i)
+        {
+            conns.emplace_back(new ConnectionData(server.url()));
+            conns.back()->setToken("token");
+            conns.back()->setNetworkAccessScope(scope.first);
+        }
+        qint64 elapsedMs = 0, totalLatencyMs = 0, maxLatencyMs = 0;
+        for (int i = 0; i < rounds; ++i)
+        {
+            const auto r = runRound(conns, requests);
+            if (r.succeeded != connections * requests)
+            {
+                cout << r.succeeded << " of " << connections * requests
+                     << " request(s) succeeded" << endl;
+                return 1;
+            }
+            elapsedMs += r.elapsedMs;
+            totalLatencyMs += r.totalLatencyMs;
+            maxLatencyMs = qMax(maxLatencyMs, r.maxLatencyMs);
+        }
+        cout << scope.second << "round " << elapsedMs / rounds
+             << " ms on average; request latency "
+             << totalLatencyMs / (qint64(rounds) * connections * requests)
+             << " ms on average, " << maxLatencyMs << " ms at most" << endl;
+    }
+    cout << "Stub server answered " << server.requestsServed()
+         << " request(s); peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
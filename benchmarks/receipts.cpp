@@ -0,0 +1,188 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures read receipt processing in a big room: a room with many members
+// and a long timeline gets batches of m.receipt events in which every member
+// moves their read marker forward, as happens with a busy room in /sync.
+// Exits with a non-zero code if the read marker of the local user is not
+// where the last receipt put it.
+// Usage:
+//   qmc-bench-receipts [members [events [batches]]]
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "connection.h"
+#include "room.h"
+#include "user.h"
+#include "jobs/syncjob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+
+#include <algorithm>
+#include <iostream>
+
+using namespace QMatrixClient;
+using Bench::connectOffline;
+using Bench::makeEventJson;
+using std::cout;
+using std::endl;
+
+static const auto RoomId = QStringLiteral("!receipts:example.org");
+
+QString memberId(int m)
+{
+    // Member 0 is the local user, see Bench::connectOffline()
+    return m == 0 ? QStringLiteral("@bench:example.org")
+                  : QStringLiteral("@user%1:example.org").arg(m);
+}
+
+QString messageId(int n)
+{
+    return makeEventJson("m.room.message", {}, n, {})
+            .value("event_id").toString();
+}
+
+QJsonObject makeRoomJson(int members, int events)
+{
+    QJsonArray stateEvents;
+    for (int m = 0; m < members; ++m)
+    {
+        QJsonObject content;
+        content.insert("membership", QStringLiteral("join"));
+        content.insert("displayname", QStringLiteral("Member %1").arg(m));
+        stateEvents.append(makeEventJson("m.room.member", memberId(m), m,
+                                         content, memberId(m)));
+    }
+    // Senders post in runs of 1 to 5 messages
+    QJsonArray timelineEvents;
+    int sender = 0;
+    for (int i = 0; i < events; ++i)
+    {
+        if (i % 7 == 0 || i % 11 == 0)
+            sender = (sender * 31 + 17) % members;
+        QJsonObject content;
+        content.insert("msgtype", QStringLiteral("m.text"));
+        content.insert("body", QStringLiteral("Message %1").arg(i));
+        timelineEvents.append(makeEventJson("m.room.message", memberId(sender),
+                                            i, content));
+    }
+    QJsonObject state;
+    state.insert("events", stateEvents);
+    QJsonObject timeline;
+    timeline.insert("events", timelineEvents);
+    QJsonObject room;
+    room.insert("state", state);
+    room.insert("timeline", timeline);
+    return room;
+}
+
+// The position of the event read by a member after the given batch
+int readPosition(int batch, int batches, int member, int events)
+{
+    return std::max(0, (batch + 1) * (events / (batches + 1)) -
+                       member * 37 % 200);
+}
+
+QJsonObject makeReceiptsJson(int batch, int batches, int members, int events)
+{
+    // The receipt event content maps event ids to the users who read them
+    QJsonObject receipts;
+    for (int m = 0; m < members; ++m)
+    {
+        const auto evtId =
+            messageId(readPosition(batch, batches, m, events));
+        auto readers = receipts.value(evtId).toObject();
+        auto mRead = readers.value("m.read").toObject();
+        QJsonObject ts;
+        ts.insert("ts", 1500000000000.0 + batch);
+        mRead.insert(memberId(m), ts);
+        readers.insert("m.read", mRead);
+        receipts.insert(evtId, readers);
+    }
+    QJsonObject receiptEvent;
+    receiptEvent.insert("type", QStringLiteral("m.receipt"));
+    receiptEvent.insert("content", receipts);
+    QJsonArray ephemeralEvents;
+    ephemeralEvents.append(receiptEvent);
+    QJsonObject ephemeral;
+    ephemeral.insert("events", ephemeralEvents);
+    QJsonObject room;
+    room.insert("ephemeral", ephemeral);
+    return room;
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-receipts [members [events [batches]]]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int members = args.size() > 0 ? args[0].toInt() : 1000;
+    const int events = args.size() > 1 ? args[1].toInt() : 50000;
+    const int batches = args.size() > 2 ? args[2].toInt() : 20;
+    if (members <= 0 || events <= batches || batches <= 0)
+        return usage();
+
+    Connection c;
+    connectOffline(c);
+    auto* room = c.provideRoom(RoomId, JoinState::Join);
+
+    QElapsedTimer et; et.start();
+    room->updateData(SyncRoomData(RoomId, JoinState::Join,
+                                  makeRoomJson(members, events)));
+    cout << members << " member(s), " << room->timelineSize()
+         << " event(s) loaded in " << et.elapsed() << " ms" << endl;
+
+    // Generating JSON is not timed
+    qint64 totalMs = 0;
+    for (int b = 0; b < batches; ++b)
+    {
+        SyncRoomData receipts { RoomId, JoinState::Join,
+                                makeReceiptsJson(b, batches, members, events) };
+        et.restart();
+        room->updateData(std::move(receipts));
+        totalMs += et.elapsed();
+    }
+    const auto expectedMarker =
+        messageId(readPosition(batches - 1, batches, 0, events));
+    const auto marker = room->readMarker();
+    // Reverse iterators: a newer event is closer to rbegin()
+    if (marker == room->timelineEdge() ||
+            marker > room->findInTimeline(expectedMarker))
+    {
+        cout << "The read marker of the local user is at "
+             << room->readMarkerEventId().toStdString() << " instead of "
+             << expectedMarker.toStdString() << " or later" << endl;
+        return 1;
+    }
+    cout << batches << " batch(es) of " << members << " receipt(s): "
+         << totalMs << " ms in total, "
+         << double(totalMs) * 1000 / batches / members << " us per receipt"
+         << endl;
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
@@ -0,0 +1,134 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures writing request bodies: BaseJob::Data::serialize() vs.
+// QJsonDocument::toJson() on message and state event contents like those
+// sent by SendEventJob and SetRoomStateJob; checks that the written JSON
+// reads back to the same objects.
+// Usage:
+//   qmc-bench-serialize [bodies [iterations]]
+
+#include "benchutil.h"
+
+#include "jobs/basejob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QStringList>
+
+#include <iostream>
+#include <vector>
+
+using namespace QMatrixClient;
+using std::cout;
+using std::endl;
+
+std::vector<BaseJob::Data> makeBodies(int count)
+{
+    std::vector<BaseJob::Data> bodies;
+    bodies.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        BaseJob::Data body;
+        if (i % 10 == 9)
+        {
+            // m.room.power_levels, the largest of the usual state events
+            QJsonObject users;
+            for (int u = 0; u < 50; ++u)
+                users.insert(QStringLiteral("@user%1:example.org").arg(u),
+                             u == 0 ? 100 : 0);
+            body.insert("users", users);
+            body.insert("users_default", 0);
+            body.insert("events_default", 0);
+            body.insert("state_default", 50);
+        }
+        else
+        {
+            body.insert("msgtype", QStringLiteral("m.text"));
+            body.insert("body", QStringLiteral("Message %1 with \"quotes\", "
+                            "a \\ backslash,\na new line and a smiley %2")
+                        .arg(i).arg(QChar(0x263A)));
+            body.insert("format", QStringLiteral("org.matrix.custom.html"));
+            body.insert("formatted_body",
+                        QStringLiteral("<p>Message <b>%1</b></p>").arg(i));
+            QJsonArray sequence;
+            sequence.append(i);
+            sequence.append(i + 0.5);
+            sequence.append(true);
+            body.insert("sequence", sequence);
+        }
+        bodies.push_back(body);
+    }
+    return bodies;
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-serialize [bodies [iterations]]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int count = args.size() > 0 ? args[0].toInt() : 100000;
+    const int iterations = args.size() > 1 ? args[1].toInt() : 5;
+    if (count <= 0 || iterations <= 0)
+        return usage();
+
+    const auto bodies = makeBodies(count);
+    for (const auto& b: bodies)
+        if (QJsonDocument::fromJson(b.serialize()).object() != b)
+        {
+            cout << "serialize() wrote " << b.serialize().toStdString()
+                 << " that doesn't read back to the same object" << endl;
+            return 1;
+        }
+
+    qint64 serializeMs = 0, indentedMs = 0, compactMs = 0;
+    qint64 serializeBytes = 0, indentedBytes = 0, compactBytes = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        serializeBytes = indentedBytes = compactBytes = 0;
+        QElapsedTimer et; et.start();
+        for (const auto& b: bodies)
+            serializeBytes += b.serialize().size();
+        serializeMs += et.restart();
+        for (const auto& b: bodies)
+            indentedBytes += QJsonDocument(b).toJson().size();
+        indentedMs += et.restart();
+        for (const auto& b: bodies)
+            compactBytes +=
+                QJsonDocument(b).toJson(QJsonDocument::Compact).size();
+        compactMs += et.elapsed();
+    }
+    cout << count << " bodies, average of " << iterations << " run(s):" << endl
+         << "serialize():        " << serializeMs / iterations << " ms, "
+         << serializeBytes << " bytes" << endl
+         << "toJson(Indented):   " << indentedMs / iterations << " ms, "
+         << indentedBytes << " bytes" << endl
+         << "toJson(Compact):    " << compactMs / iterations << " ms, "
+         << compactBytes << " bytes" << endl
+         << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
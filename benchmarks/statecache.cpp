@@ -0,0 +1,211 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures loading the rooms state cache at startup: the JSON format vs.
+// the binary memory-mapped one. The same state, taken from a synthetic
+// /sync response, is saved in both formats; each is then loaded into a new
+// Connection. After that, an incremental sync changing a tenth of the rooms
+// is applied to the state loaded from the binary cache, and the state is
+// saved again - by appending to the cache and by rewriting it from scratch.
+// Exits with a non-zero code if any two of the loaded states differ.
+// Usage:
+//   qmc-bench-statecache [rooms [events per room [iterations]]]
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "connection.h"
+#include "room.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTemporaryDir>
+
+#include <iostream>
+
+using namespace QMatrixClient;
+using Bench::connectOffline;
+using Bench::makeSyncResponse;
+using std::cout;
+using std::endl;
+
+QUrl fileUrl(const QTemporaryDir& dir, const QString& name)
+{
+    return QUrl::fromLocalFile(dir.path() + '/' + name);
+}
+
+bool saveState(Connection& c, const QUrl& url, bool toBinary)
+{
+    c.setCacheState(true);
+    c.setCacheToBinary(toBinary);
+    c.saveState(url);
+    // saveState() turns off caching if it fails
+    return c.cacheState();
+}
+
+qint64 loadState(Connection& c, const QUrl& url)
+{
+    c.setCacheState(true);
+    QElapsedTimer et; et.start();
+    c.loadState(url);
+    return et.elapsed();
+}
+
+// Returns the id of the first room that differs, or an empty string
+QString compareStates(const Connection& c1, const Connection& c2)
+{
+    const auto rooms1 = c1.roomMap();
+    const auto rooms2 = c2.roomMap();
+    for (auto it = rooms1.begin(); it != rooms1.end(); ++it)
+    {
+        auto* other = rooms2.value(it.key());
+        if (!other || other->toJson() != it.value()->toJson())
+            return it.key().first;
+    }
+    return rooms1.size() == rooms2.size() ? QString() : QStringLiteral("?");
+}
+
+bool writeFile(const QUrl& url, const QByteArray& contents)
+{
+    QFile f { url.toLocalFile() };
+    return f.open(QFile::WriteOnly) && f.write(contents) == contents.size();
+}
+
+qint64 fileSize(const QUrl& url)
+{
+    return QFile(url.toLocalFile()).size();
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-statecache [rooms [events per room [iterations]]]"
+         << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int rooms = args.size() > 0 ? args[0].toInt() : 200;
+    const int eventsPerRoom = args.size() > 1 ? args[1].toInt() : 100;
+    const int iterations = args.size() > 2 ? args[2].toInt() : 5;
+    if (rooms <= 0 || eventsPerRoom <= 0 || iterations <= 0)
+        return usage();
+
+    QTemporaryDir dir;
+    const auto syncUrl = fileUrl(dir, "sync.json");
+    const auto jsonUrl = fileUrl(dir, "state.json");
+    const auto binaryUrl = fileUrl(dir, "state.bin");
+    const auto updateUrl = fileUrl(dir, "sync-update.json");
+    const auto rewrittenUrl = fileUrl(dir, "state-rewritten.bin");
+    const auto changedRooms = qMax(1, rooms / 10);
+    if (!dir.isValid() ||
+            !writeFile(syncUrl, makeSyncResponse(rooms, eventsPerRoom)) ||
+            !writeFile(updateUrl,
+                       makeSyncResponse(changedRooms, 10, eventsPerRoom)))
+    {
+        cout << "Couldn't write sync responses to temporary files" << endl;
+        return 2;
+    }
+    // Both caches are saved from the same state
+    Connection source;
+    connectOffline(source);
+    loadState(source, syncUrl);
+    if (source.roomMap().size() != rooms)
+    {
+        cout << "Loaded " << source.roomMap().size() << " room(s) instead of "
+             << rooms << endl;
+        return 1;
+    }
+    if (!saveState(source, jsonUrl, false) ||
+            !saveState(source, binaryUrl, true))
+    {
+        cout << "Couldn't save the state" << endl;
+        return 1;
+    }
+    cout << rooms << " room(s); JSON cache " << fileSize(jsonUrl)
+         << " bytes, binary cache " << fileSize(binaryUrl) << " bytes" << endl;
+
+    qint64 jsonTotal = 0, binaryTotal = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        Connection fromJson, fromBinary;
+        connectOffline(fromJson);
+        connectOffline(fromBinary);
+        const auto jsonMs = loadState(fromJson, jsonUrl);
+        const auto binaryMs = loadState(fromBinary, binaryUrl);
+        const auto mismatch = compareStates(fromJson, fromBinary);
+        if (!mismatch.isEmpty())
+        {
+            cout << "The state loaded from the binary cache differs from "
+                    "the one loaded from JSON, room " << mismatch.toStdString()
+                 << endl;
+            return 1;
+        }
+        cout << "Iteration " << i + 1 << ": JSON " << jsonMs << " ms; binary "
+             << binaryMs << " ms" << endl;
+        jsonTotal += jsonMs;
+        binaryTotal += binaryMs;
+    }
+    cout << "Average: JSON " << jsonTotal / iterations << " ms; binary "
+         << binaryTotal / iterations << " ms" << endl;
+
+    // Loading the binary cache makes the next save append to it
+    Connection updated;
+    connectOffline(updated);
+    loadState(updated, binaryUrl);
+    loadState(updated, updateUrl);
+    const auto sizeBefore = fileSize(binaryUrl);
+    QElapsedTimer et; et.start();
+    if (!saveState(updated, binaryUrl, true))
+    {
+        cout << "Couldn't append to the binary cache" << endl;
+        return 1;
+    }
+    const auto appendMs = et.restart();
+    if (!saveState(updated, rewrittenUrl, true))
+    {
+        cout << "Couldn't rewrite the binary cache" << endl;
+        return 1;
+    }
+    const auto rewriteMs = et.elapsed();
+
+    Connection fromAppended, fromRewritten;
+    connectOffline(fromAppended);
+    connectOffline(fromRewritten);
+    loadState(fromAppended, binaryUrl);
+    loadState(fromRewritten, rewrittenUrl);
+    const auto mismatch = compareStates(fromAppended, fromRewritten);
+    if (!mismatch.isEmpty())
+    {
+        cout << "The state loaded from the appended cache differs from "
+                "the rewritten one, room " << mismatch.toStdString() << endl;
+        return 1;
+    }
+    cout << "Saving " << changedRooms << " changed room(s): appending "
+         << fileSize(binaryUrl) - sizeBefore << " bytes " << appendMs
+         << " ms; rewriting " << fileSize(rewrittenUrl) << " bytes "
+         << rewriteMs << " ms" << endl;
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
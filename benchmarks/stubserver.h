@@ -0,0 +1,93 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+// A minimal HTTP server on the loopback interface that answers every
+// request with the same JSON body; enough to drive jobs without a homeserver.
+
+#include <QtCore/QByteArray>
+#include <QtCore/QUrl>
+#include <QtNetwork/QHostAddress>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+
+#include <utility>
+
+namespace QMatrixClient
+{
+    namespace Bench
+    {
+        class StubServer : public QTcpServer
+        {
+            public:
+                explicit StubServer(QByteArray body, QObject* parent = nullptr)
+                    : QTcpServer(parent), body(std::move(body))
+                {
+                    connect(this, &QTcpServer::newConnection,
+                            this, &StubServer::acceptConnections);
+                    listen(QHostAddress::LocalHost);
+                }
+
+                QUrl url() const
+                {
+                    return QUrl(QStringLiteral("http://127.0.0.1:%1")
+                                .arg(serverPort()));
+                }
+
+                /** The number of requests answered so far */
+                int requestsServed() const { return served; }
+
+            private:
+                QByteArray body;
+                int served = 0;
+
+                void acceptConnections()
+                {
+                    while (auto* socket = nextPendingConnection())
+                    {
+                        connect(socket, &QTcpSocket::disconnected,
+                                socket, &QObject::deleteLater);
+                        connect(socket, &QTcpSocket::readyRead, socket,
+                                [this,socket] { serve(socket); });
+                    }
+                }
+
+                // Answers every complete request in the socket buffer;
+                // requests are expected to have no body (GET)
+                void serve(QTcpSocket* socket)
+                {
+                    auto buffer = socket->property("buffer").toByteArray();
+                    buffer += socket->readAll();
+                    int headerEnd;
+                    while ((headerEnd = buffer.indexOf("\r\n\r\n")) >= 0)
+                    {
+                        buffer.remove(0, headerEnd + 4);
+                        socket->write("HTTP/1.1 200 OK\r\n"
+                                      "Content-Type: application/json\r\n"
+                                      "Content-Length: " +
+                                      QByteArray::number(body.size()) +
+                                      "\r\n\r\n");
+                        socket->write(body);
+                        ++served;
+                    }
+                    socket->setProperty("buffer", buffer);
+                }
+        };
+    }
+}  // namespace QMatrixClient
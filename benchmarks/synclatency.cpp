@@ -0,0 +1,140 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures how long the event loop stays blocked while a SyncJob receives
+// and parses a large /sync response from a stub server: with the reply
+// parsed on the main thread vs. in a worker thread. The longest gap between
+// the ticks of a 1 ms timer is what a UI would experience as a freeze.
+// Usage:
+//   qmc-bench-synclatency [rooms [events per room [iterations]]]
+
+#include "benchutil.h"
+#include "stubserver.h"
+#include "syncresponse.h"
+
+#include "connectiondata.h"
+#include "jobs/syncjob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEventLoop>
+#include <QtCore/QStringList>
+#include <QtCore/QTimer>
+
+#include <iostream>
+
+using namespace QMatrixClient;
+using std::cout;
+using std::endl;
+
+class BenchSyncJob : public SyncJob
+{
+    public:
+        explicit BenchSyncJob(bool parseInBackground)
+        {
+            setParseInBackground(parseInBackground);
+        }
+};
+
+struct Result
+{
+    qint64 elapsedMs = 0;
+    qint64 maxGapMs = 0;
+    int rooms = -1;
+};
+
+Result runSync(const ConnectionData& connData, bool parseInBackground)
+{
+    Result result;
+    QEventLoop loop;
+    QElapsedTimer et, sinceTick;
+    QTimer ticker;
+    ticker.setInterval(1);
+    QObject::connect(&ticker, &QTimer::timeout, [&] {
+        result.maxGapMs = qMax(result.maxGapMs, sinceTick.restart());
+    });
+
+    auto* job = new BenchSyncJob(parseInBackground);
+    QObject::connect(job, &BaseJob::result, [&] (BaseJob*) {
+        result.elapsedMs = et.elapsed();
+        // One more tick to account for the gap until the result
+        result.maxGapMs = qMax(result.maxGapMs, sinceTick.elapsed());
+        if (job->status().good())
+            result.rooms = int(job->takeData().takeRoomData().size());
+        loop.quit();
+    });
+    et.start();
+    sinceTick.start();
+    ticker.start();
+    job->start(&connData);
+    loop.exec();
+    return result;
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-synclatency "
+            "[rooms [events per room [iterations]]]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    const int rooms = args.size() > 0 ? args[0].toInt() : 200;
+    const int eventsPerRoom = args.size() > 1 ? args[1].toInt() : 100;
+    const int iterations = args.size() > 2 ? args[2].toInt() : 5;
+    if (rooms <= 0 || eventsPerRoom <= 0 || iterations <= 0)
+        return usage();
+
+    Bench::StubServer server { Bench::makeSyncResponse(rooms, eventsPerRoom) };
+    if (!server.isListening())
+    {
+        cout << "Couldn't start the stub server: "
+             << server.errorString().toStdString() << endl;
+        return 2;
+    }
+    ConnectionData connData { server.url() };
+    cout << "Serving a synthetic sync response with " << rooms
+         << " room(s) at " << server.url().toString().toStdString() << endl;
+
+    for (const bool inBackground: { false, true })
+    {
+        qint64 totalMs = 0, worstGapMs = 0;
+        for (int i = 0; i < iterations; ++i)
+        {
+            const auto r = runSync(connData, inBackground);
+            if (r.rooms != rooms)
+            {
+                cout << "The sync job got " << r.rooms << " room(s) instead of "
+                     << rooms << endl;
+                return 1;
+            }
+            totalMs += r.elapsedMs;
+            worstGapMs = qMax(worstGapMs, r.maxGapMs);
+        }
+        cout << (inBackground ? "Worker thread: " : "Main thread:   ")
+             << "sync " << totalMs / iterations << " ms on average; "
+             << "longest event loop stall " << worstGapMs << " ms" << endl;
+    }
+    cout << "Peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
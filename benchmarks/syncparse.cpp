@@ -0,0 +1,187 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+// Measures parsing of /sync responses: SyncData::parseJson() on a document
+// parsed as a whole vs. SyncData::parseReply() on the raw text.
+// Usage:
+//   qmc-bench-syncparse [rooms [events per room [iterations]]]
+//     parses a synthetic response with the given numbers of rooms and
+//     events with both parsers; exits with a non-zero code if they disagree;
+//   qmc-bench-syncparse --file <sync.json> [iterations [json|reply]]
+//     parses a recorded response, with both parsers or only one of them.
+// The peak RSS reported in the end covers the whole run; to compare
+// the parsers by memory, run them one at a time on a recorded response.
+// Heap allocations for events are counted by Event::allocationStats();
+// after the first iteration, events mostly reuse the pooled memory.
+
+#include "benchutil.h"
+#include "syncresponse.h"
+
+#include "events/event.h"
+#include "jobs/syncjob.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QStringList>
+
+#include <iostream>
+
+using namespace QMatrixClient;
+using Bench::makeSyncResponse;
+using std::cout;
+using std::endl;
+
+struct Result
+{
+    qint64 elapsedMs = 0;
+    size_t rooms = 0;
+    size_t events = 0;
+    QString nextBatch;
+};
+
+void countEvents(SyncData& data, Result& result)
+{
+    result.nextBatch = data.nextBatch();
+    auto roomData = data.takeRoomData();
+    result.rooms = roomData.size();
+    for (const auto& r: roomData)
+        result.events += r.state.size() + r.timeline.size();
+}
+
+Result benchParseJson(const QByteArray& response)
+{
+    Result result;
+    QElapsedTimer et; et.start();
+    SyncData data;
+    data.parseJson(QJsonDocument::fromJson(response));
+    result.elapsedMs = et.elapsed();
+    countEvents(data, result);
+    return result;
+}
+
+Result benchParseReply(const QByteArray& response)
+{
+    Result result;
+    QElapsedTimer et; et.start();
+    SyncData data;
+    if (!data.parseReply(response).good())
+        return result;
+    result.elapsedMs = et.elapsed();
+    countEvents(data, result);
+    return result;
+}
+
+int usage()
+{
+    cout << "Usage: qmc-bench-syncparse [rooms [events per room [iterations]]]"
+         << endl << "       qmc-bench-syncparse --file <sync.json> "
+                    "[iterations [json|reply]]" << endl;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    auto args = app.arguments();
+    args.removeFirst();
+
+    QByteArray response;
+    int expectedRooms = -1;
+    int iterations = 5;
+    bool runJson = true, runReply = true;
+    if (!args.isEmpty() && args.front() == "--file")
+    {
+        if (args.size() < 2)
+            return usage();
+        QFile f { args[1] };
+        if (!f.open(QFile::ReadOnly))
+        {
+            cout << "Couldn't open " << args[1].toStdString() << endl;
+            return 2;
+        }
+        response = f.readAll();
+        if (args.size() > 2)
+            iterations = args[2].toInt();
+        if (args.size() > 3)
+        {
+            runJson = args[3] == "json";
+            runReply = args[3] == "reply";
+            if (!runJson && !runReply)
+                return usage();
+        }
+        cout << "Recorded sync response: ";
+    }
+    else
+    {
+        const int rooms = args.size() > 0 ? args[0].toInt() : 200;
+        const int eventsPerRoom = args.size() > 1 ? args[1].toInt() : 100;
+        if (rooms <= 0 || eventsPerRoom <= 0)
+            return usage();
+        if (args.size() > 2)
+            iterations = args[2].toInt();
+        response = makeSyncResponse(rooms, eventsPerRoom);
+        expectedRooms = rooms;
+        cout << "Synthetic sync response, " << rooms << " room(s): ";
+    }
+    if (iterations <= 0)
+        return usage();
+    cout << response.size() << " bytes" << endl;
+
+    qint64 jsonTotal = 0, replyTotal = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto allocsBefore = Event::allocationStats();
+        const auto viaJson = runJson ? benchParseJson(response) : Result();
+        const auto viaReply = runReply ? benchParseReply(response) : Result();
+        const auto allocsAfter = Event::allocationStats();
+        if (runJson && runReply &&
+                ((expectedRooms >= 0 && viaJson.rooms != size_t(expectedRooms))
+                 || viaReply.rooms != viaJson.rooms
+                 || viaReply.events != viaJson.events
+                 || viaReply.nextBatch != viaJson.nextBatch))
+        {
+            cout << "Parsers disagree: parseJson() got " << viaJson.rooms
+                 << " room(s), " << viaJson.events << " event(s); "
+                    "parseReply() got " << viaReply.rooms << " room(s), "
+                 << viaReply.events << " event(s)" << endl;
+            return 1;
+        }
+        cout << "Iteration " << i + 1 << ":";
+        if (runJson)
+            cout << " parseJson() " << viaJson.elapsedMs << " ms;";
+        if (runReply)
+            cout << " parseReply() " << viaReply.elapsedMs << " ms;";
+        cout << " " << (runJson ? viaJson : viaReply).events << " event(s) in "
+             << (runJson ? viaJson : viaReply).rooms << " room(s); "
+             << allocsAfter.systemAllocations - allocsBefore.systemAllocations
+             << " heap allocation(s) for "
+             << allocsAfter.events - allocsBefore.events << " event(s)"
+             << endl;
+        jsonTotal += viaJson.elapsedMs;
+        replyTotal += viaReply.elapsedMs;
+    }
+    cout << "Average:";
+    if (runJson)
+        cout << " parseJson() " << jsonTotal / iterations << " ms;";
+    if (runReply)
+        cout << " parseReply() " << replyTotal / iterations << " ms;";
+    cout << " peak RSS " << Bench::peakRssKb() << " KiB" << endl;
+    return 0;
+}
@@ -0,0 +1,109 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+// A generator of synthetic /sync responses shared by the benchmarks
+
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+
+namespace QMatrixClient
+{
+    namespace Bench
+    {
+        inline QJsonObject makeEventJson(const QString& type,
+                                         const QString& sender, int n,
+                                         const QJsonObject& content,
+                                         const QString& stateKey = {})
+        {
+            QJsonObject e;
+            e.insert("type", type);
+            e.insert("event_id", QStringLiteral("$%1%2:example.org").arg(type).arg(n));
+            e.insert("sender", sender);
+            e.insert("origin_server_ts", 1500000000000.0 + n);
+            e.insert("content", content);
+            if (type != "m.room.message")
+                e.insert("state_key", stateKey);
+            return e;
+        }
+
+        /**
+         * A /sync response with joined rooms full of members and messages
+         *
+         * Events are numbered from firstEvent on in every room; a response
+         * with a different firstEvent has new messages and new display names
+         * for the same members.
+         */
+        inline QByteArray makeSyncResponse(int rooms, int eventsPerRoom,
+                                           int firstEvent = 0)
+        {
+            QJsonObject joinedRooms;
+            for (int r = 0; r < rooms; ++r)
+            {
+                QJsonArray stateEvents;
+                QJsonArray timelineEvents;
+                for (int i = firstEvent; i < firstEvent + eventsPerRoom; ++i)
+                {
+                    const auto userId =
+                        QStringLiteral("@user%1:example.org").arg(i % 50);
+                    if (i < firstEvent + 50)
+                    {
+                        QJsonObject content;
+                        content.insert("membership", QStringLiteral("join"));
+                        content.insert("displayname",
+                                       QStringLiteral("User %1").arg(i));
+                        stateEvents.append(makeEventJson("m.room.member",
+                                                         userId, i, content,
+                                                         userId));
+                    }
+                    QJsonObject content;
+                    content.insert("msgtype", QStringLiteral("m.text"));
+                    content.insert("body",
+                        QStringLiteral("Message %1 in room %2, with some text "
+                                       "to make it look like a real one")
+                            .arg(i).arg(r));
+                    timelineEvents.append(makeEventJson("m.room.message",
+                                                        userId, i, content));
+                }
+                QJsonObject state;
+                state.insert("events", stateEvents);
+                QJsonObject timeline;
+                timeline.insert("events", timelineEvents);
+                timeline.insert("limited", true);
+                timeline.insert("prev_batch", QStringLiteral("p%1").arg(r));
+                QJsonObject room;
+                room.insert("state", state);
+                room.insert("timeline", timeline);
+                QJsonObject noEvents;
+                noEvents.insert("events", QJsonArray());
+                room.insert("ephemeral", noEvents);
+                room.insert("account_data", noEvents);
+                joinedRooms.insert(QStringLiteral("!room%1:example.org").arg(r),
+                                   room);
+            }
+            QJsonObject roomsObj;
+            roomsObj.insert("join", joinedRooms);
+            QJsonObject root;
+            root.insert("next_batch", QStringLiteral("s1_2_3"));
+            root.insert("rooms", roomsObj);
+            return QJsonDocument(root).toJson(QJsonDocument::Compact);
+        }
+    }
+}  // namespace QMatrixClient
@@ -21,6 +21,8 @@
 #include "user.h"
 #include "events/event.h"
 #include "room.h"
+#include "statecache.h"
+#include "eventstore.h"
 #include "jobs/generated/login.h"
 #include "jobs/generated/logout.h"
 #include "jobs/sendeventjob.h"
@@ -29,6 +31,7 @@
 #include "jobs/roommessagesjob.h"
 #include "jobs/syncjob.h"
 #include "jobs/mediathumbnailjob.h"
+#include "jobs/backoffmanager.h"
 
 #include <QtNetwork/QDnsLookup>
 #include <QtCore/QFile>
@@ -37,6 +40,9 @@
 #include <QtCore/QStandardPaths>
 #include <QtCore/QStringBuilder>
 #include <QtCore/QElapsedTimer>
+#include <QtCore/QSet>
+
+#include <algorithm>
 
 using namespace QMatrixClient;
 
@@ -66,6 +72,28 @@ class Connection::Private
         SyncJob* syncJob;
 
         bool cacheState = true;
+        bool cacheToBinary = true;
+        bool cacheTimeline = true;
+        int timelineBudget = 0;
+        int totalTimelineBudget = 0;
+
+        // Bookkeeping for incremental saves of the binary state cache:
+        // the file last written or loaded, the rooms that have a record
+        // in it, the rooms deleted since then and the total number
+        // of records in the file (including stale ones).
+        QString savedStateFile;
+        QSet<QPair<QString, bool>> savedRooms;
+        QSet<QPair<QString, bool>> deletedRooms;
+        int savedRecords = 0;
+
+        void enforceTotalTimelineBudget();
+        QString safeUserId() const;
+        QString stateCachePath(bool binary) const;
+        bool saveStateToBinary(const QString& fileName);
+        bool rewriteStateCache(StateCache& cache);
+        bool appendToStateCache(StateCache& cache);
+        void saveStateToJson(QFile& outfile) const;
+        bool loadStateFromBinary(const QString& fileName);
 };
 
 Connection::Connection(const QUrl& server, QObject* parent)
@@ -73,6 +101,8 @@ Connection::Connection(const QUrl& server, QObject* parent)
     , d(new Private(server))
 {
     d->q = this; // All d initialization should occur before this line
+    connect(d->data->backoffManager(), &BackoffManager::networkAvailabilityChanged,
+            this, &Connection::networkAvailabilityChanged);
 }
 
 Connection::Connection()
@@ -178,7 +208,51 @@ void Connection::onSyncSuccess(SyncData &&data) {
         if ( auto* r = provideRoom(roomData.roomId, roomData.joinState) )
             r->updateData(std::move(roomData));
     }
+    d->enforceTotalTimelineBudget();
+    // Once per sync rather than after every eviction, see trimAllocations()
+    Event::trimAllocations();
+}
+
+void Connection::Private::enforceTotalTimelineBudget()
+{
+    if (totalTimelineBudget <= 0)
+        return;
+
+    std::vector<Room*> rooms;
+    rooms.reserve(size_t(roomMap.size()));
+    int total = 0;
+    for (auto* r: roomMap)
+    {
+        rooms.push_back(r);
+        total += r->timelineSize();
+    }
+    if (total <= totalTimelineBudget)
+        return;
 
+    // Find the largest per-room cap that fits all timelines into the budget,
+    // so that only the longest timelines get trimmed, down to the same size.
+    std::sort(rooms.begin(), rooms.end(), [] (Room* r1, Room* r2) {
+        return r1->timelineSize() > r2->timelineSize();
+    });
+    int cap = 0;
+    int rest = total; // Events in rooms not yet trimmed down to the cap
+    for (size_t i = 0; i < rooms.size(); ++i)
+    {
+        rest -= rooms[i]->timelineSize();
+        // Rooms [0, i] get trimmed to cap, the rest stays as is
+        cap = (totalTimelineBudget - rest) / int(i + 1);
+        if (i + 1 == rooms.size() || cap >= rooms[i + 1]->timelineSize())
+            break;
+    }
+    int evicted = 0;
+    for (auto* r: rooms)
+    {
+        if (r->timelineSize() <= cap)
+            break;
+        evicted += r->evictOldestEvents(cap);
+    }
+    qCDebug(MAIN) << "Evicted" << evicted << "event(s) to fit"
+                  << totalTimelineBudget << "events in total";
 }
 
 void Connection::stopSync()
@@ -251,15 +325,25 @@ ForgetRoomJob* Connection::forgetRoom(const QString& id)
     {
         // If the room happens to be in the map (possible in both forms),
         // delete the found object(s).
+        const auto storeFileName =
+                EventStore::fileName(timelineCachePath(), id);
+        bool roomFound = false;
         for (auto f: {false, true})
             if (auto r = d->roomMap.take({ id, f }))
             {
+                d->deletedRooms.insert({ id, f });
                 emit aboutToDeleteRoom(r);
                 qCDebug(MAIN) << "Room" << id
                               << "in join state" << toCString(r->joinState())
                               << "will be deleted";
+                // The room keeps its event store open until deleted
+                connect(r, &QObject::destroyed,
+                        [storeFileName] { QFile::remove(storeFileName); });
                 r->deleteLater();
+                roomFound = true;
             }
+        if (!roomFound)
+            QFile::remove(storeFileName);
     });
     return forgetJob;
 }
@@ -384,6 +468,7 @@ Room* Connection::provideRoom(const QString& id, JoinState joinState)
         {
             qCDebug(MAIN) << "Deleting Invite state for room" << prevInvite->id();
             emit aboutToDeleteRoom(prevInvite);
+            d->deletedRooms.insert({ id, true });
             delete prevInvite;
         }
     }
@@ -415,21 +500,158 @@ void Connection::saveState(const QUrl &toFile) const
     if (!stateFile.dir().exists())
         stateFile.dir().mkpath(".");
 
-    QFile outfile { stateFile.absoluteFilePath() };
-    if (!outfile.open(QFile::WriteOnly))
+    qCDebug(MAIN) << "Writing state to file" << stateFile.absoluteFilePath();
+    if (d->cacheToBinary)
     {
-        qCWarning(MAIN) << "Error opening" << stateFile.absoluteFilePath()
-                        << ":" << outfile.errorString();
-        qCWarning(MAIN) << "Caching the rooms state disabled";
-        d->cacheState = false;
-        return;
+        if (!d->saveStateToBinary(stateFile.absoluteFilePath()))
+        {
+            qCWarning(MAIN) << "Caching the rooms state disabled";
+            d->cacheState = false;
+            return;
+        }
+    }
+    else
+    {
+        QFile outfile { stateFile.absoluteFilePath() };
+        if (!outfile.open(QFile::WriteOnly))
+        {
+            qCWarning(MAIN) << "Error opening" << stateFile.absoluteFilePath()
+                            << ":" << outfile.errorString();
+            qCWarning(MAIN) << "Caching the rooms state disabled";
+            d->cacheState = false;
+            return;
+        }
+        d->saveStateToJson(outfile);
+    }
+    qCDebug(PROFILER) << "*** Cached state for" << userId()
+                      << "saved in" << et.elapsed() << "ms";
+}
+
+bool Connection::Private::saveStateToBinary(const QString& fileName)
+{
+    // A garbage allowance so that small caches don't get compacted too often
+    static const int ExtraRecordsAllowed = 100;
+
+    StateCache cache { fileName };
+    if (fileName == savedStateFile &&
+            savedRecords <= 2 * savedRooms.size() + ExtraRecordsAllowed &&
+            cache.openForAppending())
+    {
+        if (appendToStateCache(cache))
+            return true;
+
+        // Some of the records may have made it to the file; better start
+        // from scratch than keep track of those
+        qCWarning(MAIN) << "Error writing state to" << fileName
+                        << ":" << cache.errorString();
+        savedStateFile.clear();
+    }
+
+    qCDebug(MAIN) << "Rewriting the state cache from scratch";
+    if (!cache.openForWriting())
+    {
+        qCWarning(MAIN) << "Error opening" << fileName
+                        << ":" << cache.errorString();
+        return false;
+    }
+    // The old cache stays intact unless the new one is written completely
+    const bool ok = rewriteStateCache(cache);
+    if (ok)
+        savedStateFile = fileName;
+    else
+        qCWarning(MAIN) << "Error writing state to" << fileName
+                        << ":" << cache.errorString();
+    return ok;
+}
+
+bool Connection::Private::rewriteStateCache(StateCache& cache)
+{
+    if (!cache.writeNextBatch(data->lastEvent()))
+        return false;
+    QSet<QPair<QString, bool>> newSavedRooms;
+    QList<Room*> roomsSaved;
+    for (auto i : roomMap)
+    {
+        if (i->joinState() == JoinState::Leave) // Don't save rooms in Leave state
+            continue;
+        if (!cache.writeRoom(i->id(), i->joinState(), i->toJson()))
+            return false;
+        newSavedRooms.insert({ i->id(), i->joinState() == JoinState::Invite });
+        roomsSaved.push_back(i);
+    }
+    if (!cache.commit())
+        return false;
+
+    savedRooms.swap(newSavedRooms);
+    deletedRooms.clear();
+    savedRecords = savedRooms.size() + 1;
+    for (auto* r: roomsSaved)
+        r->markStateSaved();
+    return true;
+}
+
+bool Connection::Private::appendToStateCache(StateCache& cache)
+{
+    // The bookkeeping is only updated once all records are written
+    auto newSavedRooms = savedRooms;
+    int newRecords = 0;
+    for (const auto& key: deletedRooms)
+        if (newSavedRooms.contains(key))
+        {
+            if (!cache.writeRoomRemoval(key.first,
+                    key.second ? JoinState::Invite : JoinState::Leave))
+                return false;
+            newSavedRooms.remove(key);
+            ++newRecords;
+        }
+
+    int roomsWritten = 0;
+    QList<Room*> roomsSaved;
+    for (auto i : roomMap)
+    {
+        if (!i->isStateDirty())
+            continue;
+
+        const auto key = qMakePair(i->id(), i->joinState() == JoinState::Invite);
+        if (i->joinState() == JoinState::Leave)
+        {
+            if (newSavedRooms.contains(key) &&
+                    !cache.writeRoomRemoval(i->id(), i->joinState()))
+                return false;
+            if (newSavedRooms.remove(key))
+                ++newRecords;
+        }
+        else
+        {
+            if (!cache.writeRoom(i->id(), i->joinState(), i->toJson()))
+                return false;
+            newSavedRooms.insert(key);
+            ++newRecords;
+            ++roomsWritten;
+        }
+        roomsSaved.push_back(i);
     }
+    if (!cache.writeNextBatch(data->lastEvent()) || !cache.commit())
+        return false;
+    ++newRecords;
 
+    savedRooms.swap(newSavedRooms);
+    savedRecords += newRecords;
+    deletedRooms.clear();
+    for (auto* r: roomsSaved)
+        r->markStateSaved();
+    qCDebug(MAIN) << "Appended" << roomsWritten << "changed room(s) to"
+                  << savedStateFile;
+    return true;
+}
+
+void Connection::Private::saveStateToJson(QFile& outfile) const
+{
     QJsonObject roomObj;
     {
         QJsonObject rooms;
         QJsonObject inviteRooms;
-        for (auto i : roomMap()) // Pass on rooms in Leave state
+        for (auto i : roomMap) // Pass on rooms in Leave state
         {
             if (i->joinState() == JoinState::Invite)
                 inviteRooms.insert(i->id(), i->toJson());
@@ -444,15 +666,11 @@ void Connection::saveState(const QUrl &toFile) const
     }
 
     QJsonObject rootObj;
-    rootObj.insert("next_batch", d->data->lastEvent());
+    rootObj.insert("next_batch", data->lastEvent());
     rootObj.insert("rooms", roomObj);
 
-    QByteArray data = QJsonDocument(rootObj).toJson(QJsonDocument::Compact);
-
-    qCDebug(MAIN) << "Writing state to file" << outfile.fileName();
-    outfile.write(data.data(), data.size());
-    qCDebug(PROFILER) << "*** Cached state for" << userId()
-                      << "saved in" << et.elapsed() << "ms";
+    QByteArray json = QJsonDocument(rootObj).toJson(QJsonDocument::Compact);
+    outfile.write(json.data(), json.size());
 }
 
 void Connection::loadState(const QUrl &fromFile)
@@ -461,30 +679,89 @@ void Connection::loadState(const QUrl &fromFile)
         return;
 
     QElapsedTimer et; et.start();
-    QFile file {
-        fromFile.isEmpty() ? stateCachePath() : fromFile.toLocalFile()
-    };
+    QString fileName = fromFile.toLocalFile();
+    if (fromFile.isEmpty())
+    {
+        // Pick up a cache in the other format if there's none in
+        // the preferred one, e.g. after changing cacheToBinary()
+        fileName = stateCachePath();
+        if (!QFile::exists(fileName))
+            fileName = d->stateCachePath(!d->cacheToBinary);
+    }
+    QFile file { fileName };
     if (!file.exists())
     {
         qCDebug(MAIN) << "No state cache file found";
         return;
     }
-    file.open(QFile::ReadOnly);
-    QByteArray data = file.readAll();
+    if (StateCache::isStateCache(fileName))
+    {
+        if (!d->loadStateFromBinary(fileName))
+            return;
+    }
+    else
+    {
+        file.open(QFile::ReadOnly);
+        QByteArray data = file.readAll();
 
-    SyncData sync;
-    sync.parseJson(QJsonDocument::fromJson(data));
-    onSyncSuccess(std::move(sync));
+        SyncData sync;
+        sync.parseJson(QJsonDocument::fromJson(data));
+        onSyncSuccess(std::move(sync));
+    }
     qCDebug(PROFILER) << "*** Cached state for" << userId()
                       << "loaded in" << et.elapsed() << "ms";
 }
 
+bool Connection::Private::loadStateFromBinary(const QString& fileName)
+{
+    // Room JSON objects below point into the mapped file; they are only
+    // used to construct transient SyncRoomData, none of it outlives cache.
+    StateCache cache { fileName };
+    if (!cache.openForReading())
+        return false;
+
+    data->setLastEvent(cache.nextBatch());
+    savedRooms.clear();
+    deletedRooms.clear();
+    cache.forEachRoom(
+        [this] (const QString& roomId, JoinState joinState,
+                const QJsonObject& roomState)
+        {
+            if (auto* r = q->provideRoom(roomId, joinState))
+            {
+                r->updateData(SyncRoomData(roomId, joinState, roomState));
+                // The room is exactly as it's saved in the cache
+                r->markStateSaved();
+                savedRooms.insert({ roomId, joinState == JoinState::Invite });
+            }
+        });
+    savedStateFile = fileName;
+    savedRecords = cache.recordCount();
+    return true;
+}
+
 QString Connection::stateCachePath() const
 {
-    auto safeUserId = userId();
+    return d->stateCachePath(d->cacheToBinary);
+}
+
+QString Connection::Private::safeUserId() const
+{
+    auto safeUserId = userId;
     safeUserId.replace(':', '_');
+    return safeUserId;
+}
+
+QString Connection::Private::stateCachePath(bool binary) const
+{
     return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
-            % '/' % safeUserId % "_state.json";
+            % '/' % safeUserId() % (binary ? "_state.bin" : "_state.json");
+}
+
+QString Connection::timelineCachePath() const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)
+            % '/' % d->safeUserId() % "_timeline";
 }
 
 bool Connection::cacheState() const
@@ -500,3 +777,106 @@ void Connection::setCacheState(bool newValue)
         emit cacheStateChanged();
     }
 }
+
+bool Connection::cacheToBinary() const
+{
+    return d->cacheToBinary;
+}
+
+void Connection::setCacheToBinary(bool newValue)
+{
+    if (d->cacheToBinary != newValue)
+    {
+        d->cacheToBinary = newValue;
+        emit cacheToBinaryChanged();
+    }
+}
+
+bool Connection::cacheTimeline() const
+{
+    return d->cacheTimeline;
+}
+
+void Connection::setCacheTimeline(bool newValue)
+{
+    if (d->cacheTimeline != newValue)
+    {
+        d->cacheTimeline = newValue;
+        emit cacheTimelineChanged();
+    }
+}
+
+int Connection::timelineBudget() const
+{
+    return d->timelineBudget;
+}
+
+void Connection::setTimelineBudget(int maxEvents)
+{
+    if (d->timelineBudget != maxEvents)
+    {
+        d->timelineBudget = maxEvents;
+        emit timelineBudgetChanged();
+    }
+}
+
+int Connection::totalTimelineBudget() const
+{
+    return d->totalTimelineBudget;
+}
+
+void Connection::setTotalTimelineBudget(int maxEvents)
+{
+    if (d->totalTimelineBudget != maxEvents)
+    {
+        d->totalTimelineBudget = maxEvents;
+        emit timelineBudgetChanged();
+        d->enforceTotalTimelineBudget();
+    }
+}
+
+ConnectionData::NetworkAccessScope Connection::networkAccessScope() const
+{
+    return d->data->networkAccessScope();
+}
+
+void Connection::setNetworkAccessScope(ConnectionData::NetworkAccessScope scope)
+{
+    d->data->setNetworkAccessScope(scope);
+}
+
+bool Connection::http2Allowed() const
+{
+    return d->data->http2Allowed();
+}
+
+void Connection::setHttp2Allowed(bool allowed)
+{
+    d->data->setHttp2Allowed(allowed);
+}
+
+bool Connection::keepAlive() const
+{
+    return d->data->keepAlive();
+}
+
+void Connection::setKeepAlive(bool keepAlive)
+{
+    d->data->setKeepAlive(keepAlive);
+}
+
+int Connection::residentEventsCount() const
+{
+    int count = 0;
+    for (auto* r: d->roomMap)
+        count += r->timelineSize();
+    return count;
+}
+
+int Connection::evictedEventsCount() const
+{
+    int count = 0;
+    for (auto* r: d->roomMap)
+        count += r->evictedEventsCount();
+    return count;
+}
@@ -20,6 +20,7 @@
 
 #include "jobs/generated/leaving.h"
 #include "joinstate.h"
+#include "connectiondata.h"
 
 #include <QtCore/QObject>
 #include <QtCore/QUrl>
@@ -33,7 +34,6 @@ namespace QMatrixClient
     class User;
     class RoomEvent;
     class ConnectionPrivate;
-    class ConnectionData;
 
     class SyncJob;
     class SyncData;
@@ -49,6 +49,26 @@ namespace QMatrixClient
              * \sa loadState(), saveState()
              */
             Q_PROPERTY(bool cacheState READ cacheState WRITE setCacheState NOTIFY cacheStateChanged)
+            /** Whether the rooms state is cached in the binary format
+             * (the default) or as JSON
+             * \sa StateCache, stateCachePath()
+             */
+            Q_PROPERTY(bool cacheToBinary READ cacheToBinary WRITE setCacheToBinary NOTIFY cacheToBinaryChanged)
+            /** Whether room timelines should be stored locally, in addition
+             * to the rooms state; only works along with cacheState
+             * \sa timelineCachePath(), EventStore
+             */
+            Q_PROPERTY(bool cacheTimeline READ cacheTimeline WRITE setCacheTimeline NOTIFY cacheTimelineChanged)
+            /** The default number of events a room keeps in its timeline
+             * when new events arrive; 0 (the default) means no limit
+             * \sa Room::timelineBudget(), Room::evictOldestEvents()
+             */
+            Q_PROPERTY(int timelineBudget READ timelineBudget WRITE setTimelineBudget NOTIFY timelineBudgetChanged)
+            /** The number of events all rooms of the connection keep in their
+             * timelines together; checked after each sync, evicting events
+             * from the longest timelines first. 0 (the default) means no limit
+             */
+            Q_PROPERTY(int totalTimelineBudget READ totalTimelineBudget WRITE setTotalTimelineBudget NOTIFY timelineBudgetChanged)
         public:
             using room_factory_t =
                 std::function<Room*(Connection*, const QString&, JoinState joinState)>;
@@ -110,6 +130,9 @@ namespace QMatrixClient
             /**
              * Call this before first sync to load from previously saved file.
              *
+             * Both the binary and the JSON formats of the cache are
+             * understood; the format is detected from the file contents.
+             *
              * \param fromFile A local path to read the state from. Uses QUrl
              * to be QML-friendly. Empty parameter means using a path
              * defined by stateCachePath().
@@ -118,7 +141,11 @@ namespace QMatrixClient
             /**
              * This method saves the current state of rooms (but not messages
              * in them) to a local cache file, so that it could be loaded by
-             * loadState() on a next run of the client.
+             * loadState() on a next run of the client. The format of the file
+             * depends on cacheToBinary(). In the binary format, only rooms
+             * changed since the previous save (see Room::isStateDirty()) are
+             * appended to the file, which is compacted once in a while;
+             * the JSON file is rewritten completely every time.
              *
              * \param toFile A local path to save the state to. Uses QUrl to be
              * QML-friendly. Empty parameter means using a path defined by
@@ -129,15 +156,49 @@ namespace QMatrixClient
             /**
              * The default path to store the cached room state, defined as
              * follows:
-             *     QStandardPaths::writeableLocation(QStandardPaths::CacheLocation) + _safeUserId + "_state.json"
+             *     QStandardPaths::writeableLocation(QStandardPaths::CacheLocation) + _safeUserId + "_state.bin"
              * where `_safeUserId` is userId() with `:` (colon) replaced with
-             * `_` (underscore)
+             * `_` (underscore); if cacheToBinary() is false, the extension
+             * is ".json" instead
              * /see loadState(), saveState()
              */
             Q_INVOKABLE QString stateCachePath() const;
+            /**
+             * The directory to store room timelines in, defined as follows:
+             *     QStandardPaths::writeableLocation(QStandardPaths::CacheLocation) + _safeUserId + "_timeline"
+             * with `_safeUserId` defined the same way as for stateCachePath()
+             * \sa cacheTimeline
+             */
+            Q_INVOKABLE QString timelineCachePath() const;
 
             bool cacheState() const;
             void setCacheState(bool newValue);
+            bool cacheToBinary() const;
+            void setCacheToBinary(bool newValue);
+            bool cacheTimeline() const;
+            void setCacheTimeline(bool newValue);
+            int timelineBudget() const;
+            void setTimelineBudget(int maxEvents);
+            int totalTimelineBudget() const;
+            void setTotalTimelineBudget(int maxEvents);
+
+            /**
+             * Network access settings of this connection; they only apply
+             * to requests sent after the change.
+             * \sa ConnectionData::NetworkAccessScope
+             */
+            ConnectionData::NetworkAccessScope networkAccessScope() const;
+            void setNetworkAccessScope(ConnectionData::NetworkAccessScope scope);
+            /** Whether to use HTTP/2 where possible; off by default */
+            bool http2Allowed() const;
+            void setHttp2Allowed(bool allowed);
+            bool keepAlive() const;
+            void setKeepAlive(bool keepAlive);
+
+            /** The number of events resident in timelines of all rooms */
+            Q_INVOKABLE int residentEventsCount() const;
+            /** The number of events evicted from timelines of all rooms */
+            Q_INVOKABLE int evictedEventsCount() const;
 
             /**
              * This is a universal method to start a job of a type passed
@@ -195,6 +256,12 @@ namespace QMatrixClient
             void loggedOut();
 
             void syncDone();
+            /**
+             * The network has been found to be down or up again, judging
+             * by consecutive failures and successes of requests
+             * \sa BackoffManager
+             */
+            void networkAvailabilityChanged(bool available);
 
             /**
              * \group Signals emitted on room transitions
@@ -261,6 +328,9 @@ namespace QMatrixClient
             //void jobError(BaseJob* job);
 
             void cacheStateChanged();
+            void cacheToBinaryChanged();
+            void cacheTimelineChanged();
+            void timelineBudgetChanged();
 
         protected:
             /**
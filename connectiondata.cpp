@@ -19,8 +19,14 @@
 #include "connectiondata.h"
 
 #include "logging.h"
+#include "jobs/jobscheduler.h"
+#include "jobs/backoffmanager.h"
 
 #include <QtNetwork/QNetworkAccessManager>
+#include <QtNetwork/QNetworkReply>
+#include <QtCore/QHash>
+
+#include <memory>
 
 using namespace QMatrixClient;
 
@@ -30,12 +36,35 @@ QNetworkAccessManager* getNam()
     return _nam;
 }
 
+QNetworkAccessManager* getNamForHost(const QUrl& baseUrl)
+{
+    // Like the global one, these are never deleted
+    static QHash<QString, QNetworkAccessManager*> nams;
+    const auto key = baseUrl.host() + ':' + QString::number(baseUrl.port());
+    auto& nam = nams[key];
+    if (!nam)
+        nam = new QNetworkAccessManager();
+    return nam;
+}
+
 struct ConnectionData::Private
 {
     QUrl baseUrl;
     QByteArray accessToken;
     QString lastEvent;
     QString deviceId;
+    // Only used with NetworkAccessScope::PerConnection; kept even if
+    // the scope changes, so that replies already in flight survive.
+    // The NAM deletes its replies along with itself, while jobs may still
+    // hold them; so ~ConnectionData() only deletes it after the last reply
+    // (jobs still attached to the scheduler drop theirs in ~JobScheduler()).
+    mutable std::unique_ptr<QNetworkAccessManager> ownNam;
+    JobScheduler scheduler;
+    BackoffManager backoff;
+
+    NetworkAccessScope namScope = NetworkAccessScope::Global;
+    bool http2Allowed = false;
+    bool keepAlive = true;
 
     mutable unsigned int txnCounter = 0;
     const qint64 id = QDateTime::currentMSecsSinceEpoch();
@@ -49,6 +78,23 @@ ConnectionData::ConnectionData(QUrl baseUrl)
 
 ConnectionData::~ConnectionData()
 {
+    if (d->ownNam)
+    {
+        auto* nam = d->ownNam.release();
+        const auto replies = nam->findChildren<QNetworkReply*>();
+        if (replies.isEmpty())
+            delete nam;
+        else
+        {
+            auto pending = std::make_shared<int>(replies.size());
+            for (auto* reply: replies)
+                QObject::connect(reply, &QObject::destroyed, nam,
+                    [nam,pending] {
+                        if (--*pending == 0)
+                            nam->deleteLater();
+                    });
+        }
+    }
     delete d;
 }
 
@@ -64,7 +110,27 @@ QUrl ConnectionData::baseUrl() const
 
 QNetworkAccessManager* ConnectionData::nam() const
 {
-    return getNam();
+    switch (d->namScope)
+    {
+        case NetworkAccessScope::PerHomeserver:
+            return getNamForHost(d->baseUrl);
+        case NetworkAccessScope::PerConnection:
+            if (!d->ownNam)
+                d->ownNam.reset(new QNetworkAccessManager());
+            return d->ownNam.get();
+        default:
+            return getNam();
+    }
+}
+
+JobScheduler* ConnectionData::jobScheduler() const
+{
+    return &d->scheduler;
+}
+
+BackoffManager* ConnectionData::backoffManager() const
+{
+    return &d->backoff;
 }
 
 void ConnectionData::setToken(QByteArray token)
@@ -110,3 +176,37 @@ QByteArray ConnectionData::generateTxnId() const
     return QByteArray::number(d->id) + 'q' +
             QByteArray::number(++d->txnCounter);
 }
+
+ConnectionData::NetworkAccessScope ConnectionData::networkAccessScope() const
+{
+    return d->namScope;
+}
+
+void ConnectionData::setNetworkAccessScope(NetworkAccessScope scope)
+{
+    d->namScope = scope;
+}
+
+bool ConnectionData::http2Allowed() const
+{
+    return d->http2Allowed;
+}
+
+void ConnectionData::setHttp2Allowed(bool allowed)
+{
+#if (QT_VERSION < QT_VERSION_CHECK(5, 8, 0))
+    if (allowed)
+        qCWarning(MAIN) << "HTTP/2 needs Qt 5.8 or newer, the setting is ignored";
+#endif
+    d->http2Allowed = allowed;
+}
+
+bool ConnectionData::keepAlive() const
+{
+    return d->keepAlive;
+}
+
+void ConnectionData::setKeepAlive(bool keepAlive)
+{
+    d->keepAlive = keepAlive;
+}
@@ -24,9 +24,26 @@ class QNetworkAccessManager;
 
 namespace QMatrixClient
 {
+    class JobScheduler;
+    class BackoffManager;
+
     class ConnectionData
     {
         public:
+            /**
+             * Which connections share a QNetworkAccessManager, and therefore
+             * a pool of HTTP connections (Qt opens at most 6 per host and
+             * network access manager):
+             * - Global: all connections in the process sharing this scope
+             *   (the default);
+             * - PerHomeserver: connections to the same homeserver;
+             * - PerConnection: each connection has its own.
+             */
+            enum class NetworkAccessScope
+            {
+                Global, PerHomeserver, PerConnection
+            };
+
             explicit ConnectionData(QUrl baseUrl);
             virtual ~ConnectionData();
 
@@ -34,7 +51,15 @@ namespace QMatrixClient
             QUrl baseUrl() const;
             const QString& deviceId() const;
 
+            /**
+             * Returns the network access manager for the connection,
+             * according to networkAccessScope() at the moment of the call
+             */
             QNetworkAccessManager* nam() const;
+            /** The scheduler of network requests for the connection */
+            JobScheduler* jobScheduler() const;
+            /** The retry manager shared by all jobs of the connection */
+            BackoffManager* backoffManager() const;
             void setToken(QByteArray accessToken);
             void setHost( QString host );
             void setPort( int port );
@@ -45,6 +70,20 @@ namespace QMatrixClient
 
             QByteArray generateTxnId() const;
 
+            // Network access settings of the connection; requests already
+            // sent are not affected by changes of these.
+            NetworkAccessScope networkAccessScope() const;
+            void setNetworkAccessScope(NetworkAccessScope scope);
+            /**
+             * Whether to use HTTP/2 where possible; off by default.
+             * Needs Qt 5.8 or newer.
+             */
+            bool http2Allowed() const;
+            void setHttp2Allowed(bool allowed);
+            /** Whether to keep HTTP connections alive between requests */
+            bool keepAlive() const;
+            void setKeepAlive(bool keepAlive);
+
         private:
             struct Private;
             Private* d;
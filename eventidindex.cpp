@@ -0,0 +1,122 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "eventidindex.h"
+
+#include <QtCore/QHash>
+
+#include <algorithm>
+#include <climits>
+
+using namespace QMatrixClient;
+
+const EventIdIndex::index_t EventIdIndex::NoIndex = INT_MIN;
+
+static const size_t MinCapacity = 16;
+
+uint EventIdIndex::hashOf(const QString& evtId)
+{
+    const auto h = qHash(evtId);
+    return h != 0 ? h : 1; // 0 is reserved for empty slots
+}
+
+int EventIdIndex::findSlot(const QString& evtId, uint hash) const
+{
+    if (slots.empty())
+        return -1;
+
+    const auto mask = slots.size() - 1;
+    for (auto i = hash & mask;; i = (i + 1) & mask)
+    {
+        const auto& s = slots[i];
+        if (s.hash == 0)
+            return -1;
+        if (s.hash == hash && getKey(s.index) == evtId)
+            return int(i);
+    }
+}
+
+EventIdIndex::index_t EventIdIndex::find(const QString& evtId) const
+{
+    const auto pos = findSlot(evtId, hashOf(evtId));
+    return pos == -1 ? NoIndex : slots[size_t(pos)].index;
+}
+
+void EventIdIndex::insert(const QString& evtId, index_t index)
+{
+    Q_ASSERT(!contains(evtId));
+    // Keep the load factor under 0.75
+    if (4 * (size_t(count) + 1) > 3 * slots.size())
+        rehash(std::max(slots.size() * 2, MinCapacity));
+
+    const auto hash = hashOf(evtId);
+    const auto mask = slots.size() - 1;
+    auto i = hash & mask;
+    while (slots[i].hash != 0)
+        i = (i + 1) & mask;
+    slots[i] = { hash, index };
+    ++count;
+}
+
+void EventIdIndex::remove(const QString& evtId)
+{
+    const auto pos = findSlot(evtId, hashOf(evtId));
+    if (pos == -1)
+        return;
+
+    // Backward shift deletion: move up entries from the same probe chain
+    // so that no tombstones are needed.
+    const auto mask = slots.size() - 1;
+    auto hole = size_t(pos);
+    for (auto j = (hole + 1) & mask; slots[j].hash != 0; j = (j + 1) & mask)
+    {
+        const auto home = slots[j].hash & mask;
+        // Can the entry at j move to the hole? Only if its home slot is
+        // not within (hole, j], cyclically.
+        const bool homeInRange = hole < j ? (home > hole && home <= j)
+                                          : (home > hole || home <= j);
+        if (!homeInRange)
+        {
+            slots[hole] = slots[j];
+            hole = j;
+        }
+    }
+    slots[hole].hash = 0;
+    --count;
+}
+
+void EventIdIndex::clear()
+{
+    slots.clear();
+    count = 0;
+}
+
+void EventIdIndex::rehash(size_t newCapacity)
+{
+    std::vector<Slot> oldSlots(newCapacity, Slot { 0, 0 });
+    oldSlots.swap(slots);
+    const auto mask = slots.size() - 1;
+    for (const auto& s: oldSlots)
+        if (s.hash != 0)
+        {
+            auto i = s.hash & mask;
+            while (slots[i].hash != 0)
+                i = (i + 1) & mask;
+            slots[i] = s;
+        }
+}
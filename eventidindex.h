@@ -0,0 +1,80 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QString>
+
+#include <functional>
+#include <vector>
+
+namespace QMatrixClient
+{
+    /**
+     * A compact index of event ids in a room timeline
+     *
+     * Unlike QHash<QString, int>, the index doesn't store event ids: each
+     * entry is only the hash of the id and the timeline index of the event,
+     * kept in an open-addressing table with linear probing. Hash collisions
+     * are resolved by comparing the looked up id with the id of the event
+     * at the stored timeline index, which is provided by a key getter
+     * (normally reading it from the timeline). Therefore an entry must be
+     * removed before the respective event leaves the timeline, and added
+     * after the event is in the timeline.
+     */
+    class EventIdIndex
+    {
+        public:
+            using index_t = int; // Same as TimelineItem::index_t
+            using key_getter_t = std::function<const QString&(index_t)>;
+
+            static const index_t NoIndex;
+
+            explicit EventIdIndex(key_getter_t keyGetter)
+                : getKey(std::move(keyGetter))
+            { }
+
+            /** @return the timeline index for the event id or NoIndex */
+            index_t find(const QString& evtId) const;
+            bool contains(const QString& evtId) const
+            {
+                return find(evtId) != NoIndex;
+            }
+            /** Adds an entry; the id should not be in the index yet */
+            void insert(const QString& evtId, index_t index);
+            void remove(const QString& evtId);
+            void clear();
+
+            int size() const { return count; }
+
+        private:
+            struct Slot
+            {
+                uint hash; //< 0 for empty slots
+                index_t index;
+            };
+            std::vector<Slot> slots;
+            int count = 0;
+            key_getter_t getKey;
+
+            static uint hashOf(const QString& evtId);
+            /** @return the slot position of the id or -1 if not found */
+            int findSlot(const QString& evtId, uint hash) const;
+            void rehash(size_t newCapacity);
+    };
+}  // namespace QMatrixClient
@@ -27,9 +27,281 @@
 #include "logging.h"
 
 #include <QtCore/QJsonDocument>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+
+#include <array>
+#include <algorithm>
+#include <new>
+#include <vector>
 
 using namespace QMatrixClient;
 
+namespace
+{
+    /**
+     * Memory for events comes in slots of a few fixed sizes; each size
+     * class carves the slots out of chunks and keeps the freed ones in
+     * a list to be reused. Chunks that have all their slots free are only
+     * returned to the heap by trim(), so that a burst of allocations
+     * and deallocations doesn't hit the heap every time. Events larger
+     * than the largest slot are allocated from the heap directly.
+     *
+     * Events are parsed in worker threads and deleted in the main
+     * thread, so each size class (and the counters of direct heap
+     * allocations) is protected by a mutex.
+     */
+    class EventPool
+    {
+        public:
+            static const size_t Granularity = 16;
+            static const size_t MaxSlotSize = 256;
+            static const size_t SlotsPerChunk = 128;
+            // trim() doesn't bother with fewer free slots in a size class
+            static const size_t TrimThreshold = 4 * SlotsPerChunk;
+
+            /**
+             * Allocates a slot for an event of the given size; if noThrow
+             * is true, returns nullptr instead of throwing std::bad_alloc
+             */
+            void* allocate(size_t size, bool noThrow = false)
+            {
+                if (size > MaxSlotSize)
+                {
+                    auto* p = heapAllocate(size, noThrow);
+                    if (p)
+                    {
+                        QMutexLocker l(&largeLock);
+                        ++largeAllocations;
+                    }
+                    return p;
+                }
+                auto& sc = sizeClasses[(size - 1) / Granularity];
+                QMutexLocker l(&sc.lock);
+                if (!sc.freeSlots &&
+                        !addChunk(sc, (size - 1) / Granularity + 1, noThrow))
+                    return nullptr;
+                auto* slot = sc.freeSlots;
+                sc.freeSlots = slot->next;
+                --sc.freeCount;
+                ++sc.allocations;
+                return slot;
+            }
+
+            void deallocate(void* p, size_t size)
+            {
+                if (size > MaxSlotSize)
+                {
+                    ::operator delete(p);
+                    return;
+                }
+                auto& sc = sizeClasses[(size - 1) / Granularity];
+                QMutexLocker l(&sc.lock);
+                freeSlot(sc, p);
+            }
+
+            /**
+             * Deallocates memory without knowing its size; only used when
+             * the constructor of an event allocated with nothrow new
+             * throws, so it doesn't need to be fast
+             */
+            void deallocate(void* p)
+            {
+                for (auto& sc: sizeClasses)
+                {
+                    QMutexLocker l(&sc.lock);
+                    if (findChunk(sc, p) != sc.chunks.cend())
+                    {
+                        freeSlot(sc, p);
+                        return;
+                    }
+                }
+                ::operator delete(p);
+            }
+
+            /** Returns the chunks with no events in them to the heap */
+            void trim()
+            {
+                for (size_t i = 0; i < sizeClasses.size(); ++i)
+                {
+                    auto& sc = sizeClasses[i];
+                    QMutexLocker l(&sc.lock);
+                    // Walking the free list is only worth it if there's
+                    // a good chance to release something
+                    if (sc.freeCount < TrimThreshold)
+                        continue;
+
+                    std::vector<size_t> freeInChunk(sc.chunks.size(), 0);
+                    for (auto* slot = sc.freeSlots; slot; slot = slot->next)
+                        ++freeInChunk[size_t(findChunk(sc, slot)
+                                             - sc.chunks.cbegin())];
+
+                    std::vector<char*> keptChunks;
+                    std::vector<char*> freedChunks;
+                    for (size_t c = 0; c < sc.chunks.size(); ++c)
+                        (freeInChunk[c] == SlotsPerChunk ? freedChunks
+                                                         : keptChunks)
+                            .push_back(sc.chunks[c]);
+                    if (freedChunks.empty())
+                        continue;
+
+                    // Rebuild the free list without the slots of freed chunks
+                    FreeSlot* kept = nullptr;
+                    for (auto* slot = sc.freeSlots; slot;)
+                    {
+                        auto* next = slot->next;
+                        const auto c =
+                            size_t(findChunk(sc, slot) - sc.chunks.cbegin());
+                        if (freeInChunk[c] != SlotsPerChunk)
+                        {
+                            slot->next = kept;
+                            kept = slot;
+                        }
+                        slot = next;
+                    }
+                    sc.freeSlots = kept;
+                    sc.freeCount -= freedChunks.size() * SlotsPerChunk;
+                    sc.chunks.swap(keptChunks);
+                    for (auto* chunk: freedChunks)
+                        ::operator delete(chunk);
+                    qCDebug(EVENTS) << "Released" << freedChunks.size()
+                        << "chunk(s) of" << (i + 1) * Granularity
+                        << "byte event slots";
+                }
+            }
+
+            Event::AllocationStats stats()
+            {
+                Event::AllocationStats result { 0, 0 };
+                {
+                    QMutexLocker l(&largeLock);
+                    result.events = result.systemAllocations =
+                            largeAllocations;
+                }
+                for (auto& sc: sizeClasses)
+                {
+                    QMutexLocker l(&sc.lock);
+                    result.events += sc.allocations;
+                    result.systemAllocations += sc.chunkAllocations;
+                }
+                return result;
+            }
+
+        private:
+            struct FreeSlot
+            {
+                FreeSlot* next;
+            };
+            struct SizeClass
+            {
+                QMutex lock;
+                FreeSlot* freeSlots = nullptr;
+                size_t freeCount = 0;
+                // Sorted by address, to find the chunk of a slot
+                std::vector<char*> chunks;
+                qint64 allocations = 0;
+                qint64 chunkAllocations = 0;
+            };
+            std::array<SizeClass, MaxSlotSize / Granularity> sizeClasses;
+            QMutex largeLock;
+            qint64 largeAllocations = 0;
+
+            static void* heapAllocate(size_t size, bool noThrow)
+            {
+                return noThrow ? ::operator new(size, std::nothrow)
+                               : ::operator new(size);
+            }
+
+            size_t slotSizeOf(const SizeClass& sc) const
+            {
+                return size_t(&sc - sizeClasses.data() + 1) * Granularity;
+            }
+
+            bool addChunk(SizeClass& sc, size_t granules, bool noThrow)
+            {
+                const auto slotSize = granules * Granularity;
+                auto* chunk = static_cast<char*>(
+                        heapAllocate(slotSize * SlotsPerChunk, noThrow));
+                if (!chunk)
+                    return false;
+                for (size_t i = SlotsPerChunk; i > 0; --i)
+                {
+                    auto* slot = reinterpret_cast<FreeSlot*>(
+                            chunk + (i - 1) * slotSize);
+                    slot->next = sc.freeSlots;
+                    sc.freeSlots = slot;
+                }
+                sc.freeCount += SlotsPerChunk;
+                sc.chunks.insert(std::upper_bound(sc.chunks.begin(),
+                                                  sc.chunks.end(), chunk),
+                                 chunk);
+                ++sc.chunkAllocations;
+                return true;
+            }
+
+            void freeSlot(SizeClass& sc, void* p)
+            {
+                auto* slot = static_cast<FreeSlot*>(p);
+                slot->next = sc.freeSlots;
+                sc.freeSlots = slot;
+                ++sc.freeCount;
+            }
+
+            /** The chunk containing p, or chunks.cend() if none does */
+            std::vector<char*>::const_iterator findChunk(const SizeClass& sc,
+                                                         const void* p) const
+            {
+                const auto* cp = static_cast<const char*>(p);
+                auto it = std::upper_bound(sc.chunks.cbegin(),
+                                           sc.chunks.cend(), cp);
+                if (it == sc.chunks.cbegin())
+                    return sc.chunks.cend();
+                --it;
+                const auto chunkSize = slotSizeOf(sc) * SlotsPerChunk;
+                return cp < *it + chunkSize ? it : sc.chunks.cend();
+            }
+    };
+
+    EventPool& eventPool()
+    {
+        // Never destroyed, as events may outlive static objects
+        static auto* pool = new EventPool;
+        return *pool;
+    }
+}
+
+void* Event::operator new(size_t size)
+{
+    return eventPool().allocate(size);
+}
+
+void* Event::operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return eventPool().allocate(size, true);
+}
+
+void Event::operator delete(void* p, size_t size)
+{
+    if (p)
+        eventPool().deallocate(p, size);
+}
+
+void Event::operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    if (p)
+        eventPool().deallocate(p);
+}
+
+void Event::trimAllocations()
+{
+    eventPool().trim();
+}
+
+Event::AllocationStats Event::allocationStats()
+{
+    return eventPool().stats();
+}
+
 Event::Event(Type type, const QJsonObject& rep)
     : _type(type), _originalJson(rep)
 {
@@ -42,49 +314,113 @@ Event::Event(Type type, const QJsonObject& rep)
 
 QByteArray Event::originalJson() const
 {
-    return QJsonDocument(_originalJson).toJson();
+    return QJsonDocument(originalJsonObject()).toJson();
 }
 
 QJsonObject Event::originalJsonObject() const
 {
-    return _originalJson;
+    if (!_contentDiscarded)
+        return _originalJson;
+
+    auto json = _originalJson;
+    restoreContentJson(&json);
+    return json;
 }
 
 const QJsonObject Event::contentJson() const
 {
-    return _originalJson["content"].toObject();
+    return originalJsonObject()["content"].toObject();
+}
+
+static Event::JsonRetention jsonRetentionPolicy = Event::JsonRetention::KeepFull;
+
+Event::JsonRetention Event::jsonRetention()
+{
+    return jsonRetentionPolicy;
+}
+
+void Event::setJsonRetention(JsonRetention policy)
+{
+    jsonRetentionPolicy = policy;
+}
+
+void Event::applyJsonRetention()
+{
+    applyJsonRetention(jsonRetentionPolicy);
+}
+
+void Event::applyJsonRetention(JsonRetention policy)
+{
+    if (policy == JsonRetention::KeepFull || _contentDiscarded)
+        return;
+
+    if (policy == JsonRetention::Discard)
+    {
+        // Everything lazily decoded has to be taken from the JSON now
+        decodeContent();
+        QJsonObject probe;
+        if (restoreContentJson(&probe))
+        {
+            _originalJson.remove("content");
+            _originalJson.remove("prev_content");
+            _contentDiscarded = true;
+        }
+    }
+    // Make a standalone copy so that the event doesn't hold the memory
+    // of the whole JSON document it has been parsed from
+    _originalJson = QJsonDocument::fromBinaryData(
+                QJsonDocument(_originalJson).toBinaryData()).object();
 }
 
 template <typename BaseEventT>
-inline BaseEventT* makeIfMatches(const QJsonObject&, const QString&)
+using factories_t = QHash<QString, typename BaseEventT::factory_t>;
+
+template <typename BaseEventT, typename... EventTs>
+inline factories_t<BaseEventT> makeFactories()
 {
-    return nullptr;
+    return { { EventTs::TypeId, &makeEvent<BaseEventT, EventTs> }... };
 }
 
-template <typename BaseEventT, typename EventT, typename... EventTs>
-inline BaseEventT* makeIfMatches(const QJsonObject& o, const QString& selector)
+// Both tables are initialised with the library's own event types on
+// the first use; custom types are added by registerType().
+static factories_t<Event>& eventFactories()
 {
-    if (selector == EventT::TypeId)
-        return new EventT(o);
+    static auto factories = makeFactories<Event, TypingEvent, ReceiptEvent>();
+    return factories;
+}
 
-    return makeIfMatches<BaseEventT, EventTs...>(o, selector);
+static factories_t<RoomEvent>& roomEventFactories()
+{
+    static auto factories = makeFactories<RoomEvent,
+        RoomMessageEvent, RoomNameEvent, RoomAliasesEvent,
+        RoomCanonicalAliasEvent, RoomMemberEvent, RoomTopicEvent,
+        RoomAvatarEvent, EncryptionEvent>();
+    return factories;
 }
 
 Event* Event::fromJson(const QJsonObject& obj)
 {
-    // Check more specific event types first
-    if (auto e = RoomEvent::fromJson(obj))
-        return e;
+    const auto type = obj["type"].toString();
+    // Room events are the most frequent ones, check them first
+    {
+        const auto& factories = roomEventFactories();
+        const auto it = factories.find(type);
+        if (it != factories.end())
+            return it.value()(obj);
+    }
+    const auto& factories = eventFactories();
+    const auto it = factories.find(type);
+    return it != factories.end() ? it.value()(obj) : nullptr;
+}
 
-    return makeIfMatches<Event,
-        TypingEvent, ReceiptEvent>(obj, obj["type"].toString());
+void Event::registerType(const QString& typeId, factory_t factory)
+{
+    eventFactories().insert(typeId, std::move(factory));
 }
 
 RoomEvent::RoomEvent(Type type, const QJsonObject& rep)
     : Event(type, rep), _id(rep["event_id"].toString())
-    , _serverTimestamp(
-          QMatrixClient::fromJson<QDateTime>(rep["origin_server_ts"]))
-    , _roomId(rep["room_id"].toString())
+    , _timestampDecoded(false), _roomId(rep["room_id"].toString())
     , _senderId(rep["sender"].toString())
     , _txnId(rep["unsigned"].toObject().value("transactionId").toString())
 {
@@ -107,6 +443,22 @@ RoomEvent::RoomEvent(Type type, const QJsonObject& rep)
         qCDebug(EVENTS) << "Event transactionId:" << _txnId;
 }
 
+const QDateTime& RoomEvent::timestamp() const
+{
+    if (!_timestampDecoded)
+    {
+        _serverTimestamp = QMatrixClient::fromJson<QDateTime>(
+                originalJsonObject()["origin_server_ts"]);
+        _timestampDecoded = true;
+    }
+    return _serverTimestamp;
+}
+
+void RoomEvent::decodeContent() const
+{
+    timestamp();
+}
+
 void RoomEvent::addId(const QString& id)
 {
     Q_ASSERT(_id.isEmpty()); Q_ASSERT(!id.isEmpty());
@@ -115,8 +467,12 @@ void RoomEvent::addId(const QString& id)
 
 RoomEvent* RoomEvent::fromJson(const QJsonObject& obj)
 {
-    return makeIfMatches<RoomEvent,
-        RoomMessageEvent, RoomNameEvent, RoomAliasesEvent,
-        RoomCanonicalAliasEvent, RoomMemberEvent, RoomTopicEvent,
-        RoomAvatarEvent, EncryptionEvent>(obj, obj["type"].toString());
+    const auto& factories = roomEventFactories();
+    const auto it = factories.find(obj["type"].toString());
+    return it != factories.end() ? it.value()(obj) : nullptr;
+}
+
+void RoomEvent::registerType(const QString& typeId, factory_t factory)
+{
+    roomEventFactories().insert(typeId, std::move(factory));
 }
@@ -25,12 +25,40 @@
 
 #include "util.h"
 
+#include <new>
+
 namespace QMatrixClient
 {
     class Event
     {
             Q_GADGET
         public:
+            /**
+             * How events keep their original JSON after applyJsonRetention()
+             *
+             * - KeepFull: keep the JSON object as received; note that
+             *   it shares the memory with the whole batch of events
+             *   it came from (e.g., the whole sync response);
+             * - KeepBinary: keep a compact standalone copy of the event's
+             *   own JSON;
+             * - Discard: only keep the top-level event fields, dropping
+             *   "content" and "prev_content" that are rebuilt from typed
+             *   data on demand. Events of types unknown to the library
+             *   can't be rebuilt and are treated as with KeepBinary.
+             *   Rebuilt JSON only has what the typed classes understand.
+             *
+             * Room stores events in the local event store (if timeline
+             * caching is on) before applying the policy and keeps at least
+             * a binary copy of events that still wait for the store.
+             * Events added while timeline caching was off may have their
+             * content discarded; if caching is turned on later, the store
+             * gets the rebuilt JSON of those.
+             */
+            enum class JsonRetention
+            {
+                KeepFull, KeepBinary, Discard
+            };
+
             enum class Type : quint16
             {
                 Unknown = 0,
@@ -48,6 +76,41 @@ namespace QMatrixClient
             explicit Event(Type type) : _type(type) { }
             Event(Type type, const QJsonObject& rep);
             Event(const Event&) = delete;
+            virtual ~Event() = default;
+
+            // Events are allocated from a pool with per-size free lists,
+            // to reduce the cost of creating and deleting hundreds of
+            // thousands of small objects when processing syncs. Declaring
+            // these hides the global forms, so the nothrow and placement
+            // forms are provided as well.
+            static void* operator new(size_t size);
+            static void* operator new(size_t size,
+                                      const std::nothrow_t&) noexcept;
+            static void* operator new(size_t, void* where) noexcept
+            {
+                return where;
+            }
+            static void operator delete(void* p, size_t size);
+            static void operator delete(void* p,
+                                        const std::nothrow_t&) noexcept;
+            static void operator delete(void*, void*) noexcept { }
+
+            /**
+             * Returns the memory of the pool not used by any event to
+             * the heap. Size classes with only a few free slots are skipped
+             * without looking at them; but the call still takes the lock
+             * of every size class, so Connection only makes it once per
+             * sync, after the rooms have evicted their old events.
+             */
+            static void trimAllocations();
+
+            /** Counters of event allocations, for profiling */
+            struct AllocationStats
+            {
+                qint64 events; //< Events allocated so far
+                qint64 systemAllocations; //< Of those, requested from the heap
+            };
+            static AllocationStats allocationStats();
 
             Type type() const { return _type; }
             bool isStateEvent() const
@@ -57,6 +120,28 @@ namespace QMatrixClient
             QByteArray originalJson() const;
             QJsonObject originalJsonObject() const;
 
+            /**
+             * @brief Decodes all fields that are normally extracted from
+             * the original JSON on first access
+             *
+             * Event classes that decode their content lazily override this;
+             * there's no need to call it except before dropping the original
+             * JSON of the event.
+             */
+            virtual void decodeContent() const { }
+
+            /** The policy used by applyJsonRetention(); KeepFull by default */
+            static JsonRetention jsonRetention();
+            static void setJsonRetention(JsonRetention policy);
+            /**
+             * Reduces the original JSON held by the event according to
+             * jsonRetention(); Room calls this for every event added
+             * to the timeline.
+             */
+            void applyJsonRetention();
+            /** Same as above but with the given policy */
+            void applyJsonRetention(JsonRetention policy);
+
             // According to the CS API spec, every event also has
             // a "content" object; but since its structure is different for
             // different types, we're implementing it per-event type
@@ -65,12 +150,36 @@ namespace QMatrixClient
 
             static Event* fromJson(const QJsonObject& obj);
 
+            using factory_t = std::function<Event*(const QJsonObject&)>;
+            /**
+             * @brief Registers a factory for events of a given type
+             *
+             * Event::fromJson() will use the factory to make events with
+             * typeId in their "type" field, replacing the one previously
+             * registered for this type, if any. Room events should be
+             * registered with RoomEvent::registerType() instead, to be
+             * available from RoomEvent::fromJson() as well. Registration is
+             * not thread-safe and is normally done at startup; see also
+             * registerEventType().
+             */
+            static void registerType(const QString& typeId, factory_t factory);
+
         protected:
             const QJsonObject contentJson() const;
+            /**
+             * Inserts "content" (and "prev_content", if applicable) rebuilt
+             * from typed data into the event JSON; returns false if
+             * the event class can't do it (the default)
+             */
+            virtual bool restoreContentJson(QJsonObject* /*json*/) const
+            {
+                return false;
+            }
 
         private:
             Type _type;
             QJsonObject _originalJson;
+            bool _contentDiscarded = false;
 
             REGISTER_ENUM(Type)
             Q_PROPERTY(Type type READ type CONSTANT)
@@ -112,7 +221,8 @@ namespace QMatrixClient
             RoomEvent(Type type, const QJsonObject& rep);
 
             const QString& id() const { return _id; }
-            const QDateTime& timestamp() const { return _serverTimestamp; }
+            /** The server timestamp, converted from JSON on first access */
+            const QDateTime& timestamp() const;
             const QString& roomId() const { return _roomId; }
             const QString& senderId() const { return _senderId; }
             const QString& transactionId() const { return _txnId; }
@@ -138,18 +248,45 @@ namespace QMatrixClient
              */
             void addId(const QString& id);
 
+            void decodeContent() const override;
+
             // "Static override" of the one in Event
             static RoomEvent* fromJson(const QJsonObject& obj);
 
+            using factory_t = std::function<RoomEvent*(const QJsonObject&)>;
+            // "Static override" of the one in Event
+            static void registerType(const QString& typeId, factory_t factory);
+
         private:
             QString _id;
-            QDateTime _serverTimestamp;
+            mutable QDateTime _serverTimestamp;
+            mutable bool _timestampDecoded = true;
             QString _roomId;
             QString _senderId;
             QString _txnId;
     };
     using RoomEvents = EventsBatch<RoomEvent>;
 
+    template <typename BaseEventT, typename EventT>
+    inline BaseEventT* makeEvent(const QJsonObject& o)
+    {
+        return new EventT(o);
+    }
+
+    /**
+     * @brief Registers a custom event type for loading from JSON
+     *
+     * EventT should have a static TypeId with the Matrix event type and
+     * a constructor accepting a QJsonObject. Room events (derived from
+     * RoomEvent) become available from both Event::fromJson() and
+     * RoomEvent::fromJson(), other events from Event::fromJson() only.
+     */
+    template <typename EventT>
+    inline void registerEventType()
+    {
+        EventT::registerType(EventT::TypeId, makeEvent<EventT, EventT>);
+    }
+
     template <typename ContentT>
     class StateEvent: public RoomEvent
     {
@@ -180,6 +317,14 @@ namespace QMatrixClient
             ContentT* prev_content() const { return _prev.data(); }
 
         protected:
+            bool restoreContentJson(QJsonObject* json) const override
+            {
+                json->insert("content", _content.toJson());
+                if (_prev)
+                    json->insert("prev_content", _prev->toJson());
+                return true;
+            }
+
             ContentT _content;
             QScopedPointer<ContentT> _prev;
     };
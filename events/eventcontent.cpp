@@ -20,9 +20,47 @@
 
 #include <QtCore/QUrl>
 #include <QtCore/QMimeDatabase>
+#include <QtCore/QMutex>
+#include <QtCore/QHash>
 
 using namespace QMatrixClient::EventContent;
 
+QMimeType QMatrixClient::EventContent::mimeTypeForName(const QString& name)
+{
+    // Names come from the network; don't let the cache grow unbounded
+    static const int MaxCachedTypes = 256;
+    static QMutex lock;
+    static QHash<QString, QMimeType> cache;
+
+    QMutexLocker l(&lock);
+    const auto it = cache.constFind(name);
+    if (it != cache.cend())
+        return it.value();
+
+    const auto type = QMimeDatabase().mimeTypeForName(name);
+    if (cache.size() < MaxCachedTypes)
+        cache.insert(name, type);
+    return type;
+}
+
+const QMimeType& QMatrixClient::EventContent::plainTextMimeType()
+{
+    static const auto type = mimeTypeForName("text/plain");
+    return type;
+}
+
+const QMimeType& QMatrixClient::EventContent::htmlMimeType()
+{
+    static const auto type = mimeTypeForName("text/html");
+    return type;
+}
+
+const QMimeType& QMatrixClient::EventContent::defaultMimeType()
+{
+    static const auto type = mimeTypeForName("application/octet-stream");
+    return type;
+}
+
 QJsonObject Base::toJson() const
 {
     QJsonObject o;
@@ -48,11 +86,11 @@ FileInfo::FileInfo(const QUrl& u, int payloadSize, const QMimeType& mimeType,
 FileInfo::FileInfo(const QUrl& u, const QJsonObject& infoJson,
                    const QString& originalFilename)
     : FileInfo(u, infoJson["size"].toInt(),
-               QMimeDatabase().mimeTypeForName(infoJson["mimetype"].toString()),
+               mimeTypeForName(infoJson["mimetype"].toString()),
                originalFilename)
 {
     if (!mimeType.isValid())
-        mimeType = QMimeDatabase().mimeTypeForData(QByteArray());
+        mimeType = defaultMimeType();
 }
 
 void FileInfo::fillInfoJson(QJsonObject* infoJson) const
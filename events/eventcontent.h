@@ -32,6 +32,21 @@ namespace QMatrixClient
 {
     namespace EventContent
     {
+        /**
+         * @brief Looks up a MIME type by name, caching the results
+         *
+         * Use this instead of QMimeDatabase::mimeTypeForName() when
+         * processing events: the database lookup takes a global lock and
+         * is relatively slow. Unknown names produce an invalid QMimeType.
+         */
+        QMimeType mimeTypeForName(const QString& name);
+
+        /** Interned MIME types commonly used in events */
+        const QMimeType& plainTextMimeType();
+        const QMimeType& htmlMimeType();
+        /** The type for unknown binary data (application/octet-stream) */
+        const QMimeType& defaultMimeType();
+
         /**
          * A base class for all content types that can be stored
          * in a RoomMessageEvent
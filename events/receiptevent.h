@@ -39,7 +39,7 @@ namespace QMatrixClient
         public:
             explicit ReceiptEvent(const QJsonObject& obj);
 
-            EventsWithReceipts eventsWithReceipts() const
+            const EventsWithReceipts& eventsWithReceipts() const
             { return _eventsWithReceipts; }
             bool unreadMessages() const { return _unreadMessages; }
 
@@ -20,8 +20,6 @@
 
 #include "logging.h"
 
-#include <QtCore/QMimeDatabase>
-
 using namespace QMatrixClient;
 using namespace EventContent;
 
@@ -80,7 +78,12 @@ RoomMessageEvent::RoomMessageEvent(const QString& plainBody,
 
 RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
     : RoomEvent(Type::RoomMessage, obj), _content(nullptr)
+    , _contentDecoded(false)
+{ }
+
+void RoomMessageEvent::loadContent() const
 {
+    _contentDecoded = true;
     const QJsonObject content = contentJson();
     if ( content.contains("msgtype") && content.contains("body") )
     {
@@ -101,23 +104,46 @@ RoomMessageEvent::RoomMessageEvent(const QJsonObject& obj)
     else
     {
         qCWarning(EVENTS) << "No body or msgtype in room message event";
-        qCWarning(EVENTS) << formatJson << obj;
+        qCWarning(EVENTS) << formatJson << originalJsonObject();
     }
 }
 
+void RoomMessageEvent::decodeContent() const
+{
+    RoomEvent::decodeContent();
+    decodeIfNeeded();
+}
+
+bool RoomMessageEvent::restoreContentJson(QJsonObject* json) const
+{
+    decodeIfNeeded();
+    // Without a typed content object there's nothing to rebuild from
+    if (!_content)
+        return false;
+
+    auto content = _content->toJson();
+    content.insert("msgtype", _msgtype);
+    content.insert("body", _plainBody);
+    json->insert("content", content);
+    return true;
+}
+
 RoomMessageEvent::MsgType RoomMessageEvent::msgtype() const
 {
+    decodeIfNeeded();
     return jsonToMsgType(_msgtype);
 }
 
 QMimeType RoomMessageEvent::mimeType() const
 {
+    decodeIfNeeded();
     return _content ? _content->type() :
-                      QMimeDatabase().mimeTypeForName("text/plain");
+                      plainTextMimeType();
 }
 
 QJsonObject RoomMessageEvent::toJson() const
 {
+    decodeIfNeeded();
     QJsonObject obj = _content ? _content->toJson() : QJsonObject();
     obj.insert("msgtype", msgTypeToJson(msgtype()));
     obj.insert("body", plainBody());
@@ -125,23 +151,21 @@ QJsonObject RoomMessageEvent::toJson() const
 }
 
 TextContent::TextContent(const QString& text, const QString& contentType)
-    : mimeType(QMimeDatabase().mimeTypeForName(contentType)), body(text)
+    : mimeType(mimeTypeForName(contentType)), body(text)
 { }
 
 TextContent::TextContent(const QJsonObject& json)
 {
-    QMimeDatabase db;
-
     // Special-casing the custom matrix.org's (actually, Riot's) way
     // of sending HTML messages.
     if (json["format"].toString() == "org.matrix.custom.html")
     {
-        mimeType = db.mimeTypeForName("text/html");
+        mimeType = htmlMimeType();
         body = json["formatted_body"].toString();
     } else {
         // Falling back to plain text, as there's no standard way to describe
         // rich text in messages.
-        mimeType = db.mimeTypeForName("text/plain");
+        mimeType = plainTextMimeType();
         body = json["body"].toString();
     }
 }
@@ -172,7 +196,8 @@ void LocationContent::fillJson(QJsonObject* o) const
 
 QMimeType LocationContent::type() const
 {
-    return QMimeDatabase().mimeTypeForData(geoUri.toLatin1());
+    // Geo URIs are plain text; no need to sniff them every time
+    return plainTextMimeType();
 }
 
 PlayableInfo::PlayableInfo(const QUrl& u, int fileSize,
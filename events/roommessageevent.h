@@ -28,6 +28,10 @@ namespace QMatrixClient
 
     /**
      * The event class corresponding to m.room.message events
+     *
+     * When made from JSON, the event only decodes its content (msgtype,
+     * body and the typed content object) when any of these is first
+     * accessed, since most events in the timeline are never looked into.
      */
     class RoomMessageEvent: public RoomEvent
     {
@@ -50,20 +54,35 @@ namespace QMatrixClient
             explicit RoomMessageEvent(const QJsonObject& obj);
 
             MsgType msgtype() const;
-            QString rawMsgtype() const       { return _msgtype; }
-            const QString& plainBody() const { return _plainBody; }
+            QString rawMsgtype() const
+                { decodeIfNeeded(); return _msgtype; }
+            const QString& plainBody() const
+                { decodeIfNeeded(); return _plainBody; }
             const EventContent::TypedBase* content() const
-                                             { return _content.data(); }
+                { decodeIfNeeded(); return _content.data(); }
             QMimeType mimeType() const;
 
             QJsonObject toJson() const;
 
+            void decodeContent() const override;
+
             static constexpr const char* TypeId = "m.room.message";
 
+        protected:
+            bool restoreContentJson(QJsonObject* json) const override;
+
         private:
-            QString _msgtype;
-            QString _plainBody;
-            QScopedPointer<EventContent::TypedBase> _content;
+            mutable QString _msgtype;
+            mutable QString _plainBody;
+            mutable QScopedPointer<EventContent::TypedBase> _content;
+            mutable bool _contentDecoded = true;
+
+            void decodeIfNeeded() const
+            {
+                if (!_contentDecoded)
+                    loadContent();
+            }
+            void loadContent() const;
 
             REGISTER_ENUM(MsgType)
     };
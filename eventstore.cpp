@@ -0,0 +1,193 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "eventstore.h"
+
+#include "logging.h"
+
+#include <QtCore/QDataStream>
+#include <QtCore/QDir>
+#include <QtCore/QJsonDocument>
+
+using namespace QMatrixClient;
+
+static const QDataStream::Version StreamVersion = QDataStream::Qt_5_0;
+
+EventStore::EventStore(const QString& fileName)
+    : file(fileName)
+{ }
+
+EventStore::~EventStore()
+{
+    close();
+}
+
+QString EventStore::fileName(const QString& dirPath, const QString& roomId)
+{
+    auto safeRoomId = roomId;
+    safeRoomId.replace(':', '_');
+    return QDir(dirPath).filePath(safeRoomId + ".events");
+}
+
+bool EventStore::open()
+{
+    close();
+    if (!file.open(QFile::ReadWrite))
+        return false;
+
+    QDataStream in { &file };
+    in.setVersion(StreamVersion);
+    qint64 goodEnd = 0;
+    while (!in.atEnd())
+    {
+        qint32 index;
+        quint32 size;
+        in >> index >> size;
+        if (in.status() != QDataStream::Ok || size == 0xFFFFFFFF ||
+                in.skipRawData(int(size)) != int(size))
+            break;
+
+        offsets.insert(index, goodEnd);
+        if (offsets.size() == 1 || index < minIdx)
+            minIdx = index;
+        if (offsets.size() == 1 || index > maxIdx)
+            maxIdx = index;
+        goodEnd = file.pos();
+    }
+    if (goodEnd != file.size())
+    {
+        qCWarning(MAIN) << "Event store" << file.fileName()
+                        << "has a broken tail, dropping"
+                        << file.size() - goodEnd << "bytes";
+        if (!file.resize(goodEnd))
+            return false;
+    }
+    return file.seek(goodEnd);
+}
+
+void EventStore::close()
+{
+    offsets.clear();
+    minIdx = 0;
+    maxIdx = -1;
+    if (file.isOpen())
+        file.close();
+}
+
+bool EventStore::clear()
+{
+    offsets.clear();
+    minIdx = 0;
+    maxIdx = -1;
+    return file.resize(0) && file.seek(0);
+}
+
+void EventStore::flush()
+{
+    file.flush();
+}
+
+bool EventStore::isEmpty() const
+{
+    return offsets.isEmpty();
+}
+
+bool EventStore::contains(index_t index) const
+{
+    return offsets.contains(index);
+}
+
+EventStore::index_t EventStore::minIndex() const
+{
+    return minIdx;
+}
+
+EventStore::index_t EventStore::maxIndex() const
+{
+    return maxIdx;
+}
+
+bool EventStore::append(index_t index, const RoomEvent* event)
+{
+    if (contains(index))
+        return true;
+
+    const auto offset = file.size();
+    if (!file.seek(offset))
+        return false;
+    QDataStream out { &file };
+    out.setVersion(StreamVersion);
+    out << qint32(index)
+        << QJsonDocument(event->originalJsonObject()).toBinaryData();
+    if (out.status() != QDataStream::Ok)
+    {
+        qCWarning(MAIN) << "Failed to save event" << event->id()
+                        << "to" << file.fileName() << ":" << errorString();
+        return false;
+    }
+
+    offsets.insert(index, offset);
+    if (offsets.size() == 1 || index < minIdx)
+        minIdx = index;
+    if (offsets.size() == 1 || index > maxIdx)
+        maxIdx = index;
+    return true;
+}
+
+RoomEvent* EventStore::load(index_t index)
+{
+    const auto it = offsets.constFind(index);
+    if (it == offsets.cend() || !file.seek(it.value()))
+        return nullptr;
+
+    QDataStream in { &file };
+    in.setVersion(StreamVersion);
+    qint32 storedIndex;
+    QByteArray data;
+    in >> storedIndex >> data;
+    if (in.status() != QDataStream::Ok || storedIndex != index)
+    {
+        qCWarning(MAIN) << "Event store" << file.fileName()
+                        << "is damaged at index" << index;
+        return nullptr;
+    }
+    const auto obj = QJsonDocument::fromBinaryData(data).object();
+    if (obj.isEmpty())
+        return nullptr;
+    if (auto e = RoomEvent::fromJson(obj))
+        return e;
+    return new RoomEvent(EventType::Unknown, obj);
+}
+
+RoomEvents EventStore::loadBackwards(index_t before, int limit)
+{
+    RoomEvents events;
+    for (auto i = before - 1; i >= minIdx && int(events.size()) < limit; --i)
+    {
+        auto e = load(i);
+        if (!e)
+            break;
+        events.push_back(e);
+    }
+    return events;
+}
+
+QString EventStore::errorString() const
+{
+    return file.errorString();
+}
@@ -0,0 +1,84 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "room.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+
+namespace QMatrixClient
+{
+    /**
+     * An on-disk, append-only store of timeline events of a single room
+     *
+     * Events are keyed by their timeline index (TimelineItem::index_t).
+     * Each record is written with QDataStream and consists of the index
+     * and the event JSON in Qt's binary format; new and historical events
+     * are appended in the order of arrival. Upon opening, only the record
+     * headers are read in order to build the index-to-offset map; events
+     * themselves are only read when requested.
+     */
+    class EventStore
+    {
+        public:
+            using index_t = TimelineItem::index_t;
+
+            explicit EventStore(const QString& fileName);
+            ~EventStore();
+
+            /** The name of the store file for the room in the directory */
+            static QString fileName(const QString& dirPath,
+                                    const QString& roomId);
+
+            /** Opens or creates the file and indexes the records in it */
+            bool open();
+            void close();
+            /** Drops all records from the store */
+            bool clear();
+            void flush();
+
+            bool isEmpty() const;
+            bool contains(index_t index) const;
+            index_t minIndex() const;
+            index_t maxIndex() const;
+
+            /**
+             * Saves the event with the given index unless the store
+             * already has it
+             */
+            bool append(index_t index, const RoomEvent* event);
+            /** Reads the event with the given index from the store */
+            RoomEvent* load(index_t index);
+            /**
+             * Reads up to limit events going back from the one right before
+             * the given index (in the newest-to-oldest order, like in
+             * historical batches); stops at the first missing index
+             */
+            RoomEvents loadBackwards(index_t before, int limit);
+
+            QString errorString() const;
+
+        private:
+            QFile file;
+            QHash<index_t, qint64> offsets;
+            index_t minIdx = 0;
+            index_t maxIdx = -1;
+    };
+}  // namespace QMatrixClient
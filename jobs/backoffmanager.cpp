@@ -0,0 +1,174 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "backoffmanager.h"
+
+#include "basejob.h"
+#include "logging.h"
+
+#include <QtCore/QDateTime>
+
+#include <algorithm>
+
+using namespace QMatrixClient;
+
+static const int BaseInterval = 2000; // ms
+static const int MaxInterval = 300000; // ms
+// Consecutive failures after which the network is considered down
+static const int FailuresToBreak = 3;
+
+BackoffManager::BackoffManager(QObject* parent)
+    : QObject(parent)
+    , randomEngine(quint32(QDateTime::currentMSecsSinceEpoch()))
+{
+    clock.start();
+    timer.setSingleShot(true);
+    connect(&timer, &QTimer::timeout, this, &BackoffManager::releaseDueJobs);
+}
+
+bool BackoffManager::isNetworkAvailable() const
+{
+    return networkAvailable;
+}
+
+void BackoffManager::reportSuccess()
+{
+    consecutiveFailures = 0;
+    probeJob = nullptr;
+    if (!networkAvailable)
+    {
+        qCDebug(JOBS) << "Network is back, releasing" << waitingJobs.size()
+                      << "waiting job(s)";
+        networkAvailable = true;
+        emit networkAvailabilityChanged(true);
+        // Jobs waiting for the probe to succeed can go now; the scheduler
+        // doesn't let them all loose at once anyway
+        const auto now = clock.elapsed();
+        QMultiMap<qint64, BaseJob*> rescheduled;
+        for (auto it = waitingJobs.begin(); it != waitingJobs.end(); ++it)
+            rescheduled.insert(std::min(it.key(), now), it.value());
+        waitingJobs.swap(rescheduled);
+        restartTimer();
+    }
+}
+
+void BackoffManager::reportFailure()
+{
+    ++consecutiveFailures;
+    probeJob = nullptr;
+    if (networkAvailable && consecutiveFailures >= FailuresToBreak)
+    {
+        qCWarning(JOBS) << "Network seems to be down after"
+                        << consecutiveFailures << "failures in a row";
+        networkAvailable = false;
+        emit networkAvailabilityChanged(false);
+    }
+}
+
+int BackoffManager::nextRetryInterval() const
+{
+    // Exponential growth, capped; the shift is limited to avoid overflow
+    const auto shift = std::min(std::max(consecutiveFailures - 1, 0), 16);
+    return std::min(BaseInterval << shift, MaxInterval);
+}
+
+int BackoffManager::scheduleRetry(BaseJob* job, int delayMs)
+{
+    cancelRetry(job);
+    int delay;
+    if (delayMs >= 0)
+    {
+        // Add up to 10% on top of what the server asked for
+        std::uniform_int_distribution<int> jitter(0, delayMs / 10);
+        delay = delayMs + jitter(randomEngine);
+    }
+    else
+    {
+        // "Equal jitter": half of the interval is fixed, half is random
+        const auto interval = nextRetryInterval();
+        std::uniform_int_distribution<int> jitter(0, interval / 2);
+        delay = interval / 2 + jitter(randomEngine);
+    }
+    waitingJobs.insert(clock.elapsed() + delay, job);
+    restartTimer();
+    return delay;
+}
+
+void BackoffManager::cancelRetry(BaseJob* job)
+{
+    if (job == probeJob)
+        probeJob = nullptr;
+    for (auto it = waitingJobs.begin(); it != waitingJobs.end(); ++it)
+        if (it.value() == job)
+        {
+            waitingJobs.erase(it);
+            restartTimer();
+            return;
+        }
+}
+
+int BackoffManager::millisToRetry(const BaseJob* job) const
+{
+    for (auto it = waitingJobs.cbegin(); it != waitingJobs.cend(); ++it)
+        if (it.value() == job)
+            return int(std::max(it.key() - clock.elapsed(), qint64(0)));
+    return 0;
+}
+
+void BackoffManager::restartTimer()
+{
+    if (waitingJobs.isEmpty())
+    {
+        timer.stop();
+        return;
+    }
+    const auto nextDue = waitingJobs.firstKey() - clock.elapsed();
+    timer.start(int(std::max(nextDue, qint64(0))));
+}
+
+void BackoffManager::releaseDueJobs()
+{
+    const auto now = clock.elapsed();
+    if (!networkAvailable)
+    {
+        // Only let one job through to probe the network; the others wait
+        // for its result or until their own time comes for another probe
+        if (!probeJob && !waitingJobs.isEmpty() && waitingJobs.firstKey() <= now)
+        {
+            probeJob = waitingJobs.take(waitingJobs.firstKey());
+            qCDebug(JOBS) << "Probing the network with" << probeJob->objectName();
+            probeJob->enqueue();
+        }
+        // Postpone the due jobs until after the next probe
+        const auto nextProbe = now + nextRetryInterval();
+        QList<BaseJob*> postponed;
+        while (!waitingJobs.isEmpty() && waitingJobs.firstKey() <= now)
+            postponed.push_back(waitingJobs.take(waitingJobs.firstKey()));
+        for (auto* job: postponed)
+            waitingJobs.insert(nextProbe, job);
+        restartTimer();
+        return;
+    }
+
+    QList<BaseJob*> dueJobs;
+    while (!waitingJobs.isEmpty() && waitingJobs.firstKey() <= now)
+        dueJobs.push_back(waitingJobs.take(waitingJobs.firstKey()));
+    restartTimer();
+    for (auto* job: dueJobs)
+        job->enqueue();
+}
@@ -0,0 +1,95 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QObject>
+#include <QtCore/QMultiMap>
+#include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+
+#include <random>
+
+namespace QMatrixClient
+{
+    class BaseJob;
+
+    /**
+     * Connection-wide retrying of failed network requests
+     *
+     * Instead of running their own retry timers, jobs that failed with
+     * a network error or a timeout wait in the manager, which passes them
+     * back to the JobScheduler when due. The retry interval grows
+     * exponentially with the number of consecutive failures on
+     * the connection (not per job) and is randomised for each job, so that
+     * jobs failed at the same time don't retry in lockstep.
+     *
+     * The manager also works as a circuit breaker: after several
+     * consecutive failures the network is considered down and only one
+     * waiting job at a time is let through to probe it; the rest are held
+     * until a probe succeeds. Changes of this state are reported by
+     * networkAvailabilityChanged().
+     */
+    class BackoffManager: public QObject
+    {
+            Q_OBJECT
+        public:
+            explicit BackoffManager(QObject* parent = nullptr);
+
+            /** Whether the network is thought to be available */
+            bool isNetworkAvailable() const;
+
+            /** A request got a response from the server, successful or not */
+            void reportSuccess();
+            /** A request failed because of a network error or a timeout */
+            void reportFailure();
+
+            /**
+             * Makes the job wait for its retry
+             * @param delayMs the minimal delay requested by the server, or
+             * -1 to use the current backoff interval
+             * @return the number of milliseconds until the retry
+             */
+            int scheduleRetry(BaseJob* job, int delayMs = -1);
+            /** Removes the job from the waiting list, if it's there */
+            void cancelRetry(BaseJob* job);
+            /** Milliseconds until the job is retried, 0 if it's not waiting */
+            int millisToRetry(const BaseJob* job) const;
+            /** The interval (before randomisation) for the next retry */
+            int nextRetryInterval() const;
+
+        signals:
+            void networkAvailabilityChanged(bool available);
+
+        private slots:
+            void releaseDueJobs();
+
+        private:
+            // Jobs waiting for retry, by the due time on the clock below
+            QMultiMap<qint64, BaseJob*> waitingJobs;
+            QElapsedTimer clock;
+            QTimer timer;
+            std::minstd_rand randomEngine;
+            int consecutiveFailures = 0;
+            bool networkAvailable = true;
+            // The job probing the network while it's down, if any
+            BaseJob* probeJob = nullptr;
+
+            void restartTimer();
+    };
+}  // namespace QMatrixClient
@@ -19,15 +19,24 @@
 #include "basejob.h"
 
 #include "connectiondata.h"
+#include "jobscheduler.h"
+#include "backoffmanager.h"
 
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkRequest>
 #include <QtNetwork/QNetworkReply>
 #include <QtCore/QTimer>
 #include <QtCore/QRegularExpression>
+#include <QtCore/QThreadPool>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QJsonArray>
+#include <QtCore/qnumeric.h>
 //#include <QtCore/QStringBuilder>
 
 #include <array>
+#include <functional>
+#include <cmath>
 
 using namespace QMatrixClient;
 
@@ -41,6 +50,17 @@ struct NetworkReplyDeleter : public QScopedPointerDeleteLater
     }
 };
 
+class ParserTask : public QRunnable
+{
+    public:
+        explicit ParserTask(std::function<void()> f) : fn(std::move(f)) { }
+
+        void run() override { fn(); }
+
+    private:
+        std::function<void()> fn;
+};
+
 class BaseJob::Private
 {
     public:
@@ -67,14 +87,125 @@ class BaseJob::Private
         Status status = NoError;
 
         QTimer timer;
-        QTimer retryTimer;
 
         size_t maxRetries = 3;
         size_t retriesTaken = 0;
+        // Set by checkReply() from a rate-limiting response; -1 if none
+        int retryAfterMs = -1;
+        // Retries after HTTP 429 have their own budget
+        size_t maxRateLimitedRetries = 10;
+        size_t rateLimitedRetries = 0;
+
+        JobPriority priority = JobPriority::Default;
+
+        bool parseInBackground = false;
+        // Acquired while the reply is being parsed in a worker thread
+        QSemaphore parserLock { 1 };
+        Status parsedStatus = NoError;
+        // Set by abandon() if the reply is being parsed at the moment;
+        // the job is deleted once the parser lets go of it
+        bool abandoned = false;
+        // Whether the job is queued or running in the scheduler
+        bool scheduled = false;
 
         LoggingCategory logCat = JOBS;
 };
 
+static void writeJson(QByteArray& out, const QJsonValue& v);
+
+static void writeJson(QByteArray& out, const QString& s)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    out.append('"');
+    for (const char c: s.toUtf8())
+    {
+        switch (c)
+        {
+            case '"': out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\b': out.append("\\b"); break;
+            case '\f': out.append("\\f"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            case '\t': out.append("\\t"); break;
+            default:
+                if (uchar(c) < 0x20)
+                    out.append("\\u00").append(hexDigits[c >> 4])
+                       .append(hexDigits[c & 0xF]);
+                else
+                    out.append(c); // UTF-8 bytes go as they are
+        }
+    }
+    out.append('"');
+}
+
+static void writeJson(QByteArray& out, const QJsonObject& o)
+{
+    out.append('{');
+    for (auto it = o.begin(); it != o.end(); ++it)
+    {
+        if (it != o.begin())
+            out.append(',');
+        writeJson(out, it.key());
+        out.append(':');
+        writeJson(out, it.value());
+    }
+    out.append('}');
+}
+
+static void writeJson(QByteArray& out, const QJsonArray& a)
+{
+    out.append('[');
+    for (auto it = a.begin(); it != a.end(); ++it)
+    {
+        if (it != a.begin())
+            out.append(',');
+        writeJson(out, *it);
+    }
+    out.append(']');
+}
+
+static void writeJson(QByteArray& out, const QJsonValue& v)
+{
+    switch (v.type())
+    {
+        case QJsonValue::Bool:
+            out.append(v.toBool() ? "true" : "false");
+            break;
+        case QJsonValue::Double:
+        {
+            const auto d = v.toDouble();
+            if (!qIsFinite(d))
+                out.append("null"); // JSON has no infinities and NaNs
+            else if (d == std::floor(d) && std::fabs(d) < 9007199254740992.0)
+                out.append(QByteArray::number(qint64(d))); // Exact integers
+            else
+                out.append(QByteArray::number(d, 'g', 17));
+            break;
+        }
+        case QJsonValue::String:
+            writeJson(out, v.toString());
+            break;
+        case QJsonValue::Array:
+            writeJson(out, v.toArray());
+            break;
+        case QJsonValue::Object:
+            writeJson(out, v.toObject());
+            break;
+        default: // Null and Undefined
+            out.append("null");
+    }
+}
+
+QByteArray BaseJob::Data::serialize() const
+{
+    // Writing directly is faster than making a QJsonDocument first, and
+    // unlike QJsonDocument::toJson() it doesn't waste bytes on indentation
+    QByteArray result;
+    writeJson(result, *this);
+    return result;
+}
+
 inline QDebug operator<<(QDebug dbg, const BaseJob* j)
 {
     return dbg << j->objectName();
@@ -94,13 +225,16 @@ BaseJob::BaseJob(HttpVerb verb, const QString& name, const QString& endpoint,
     setObjectName(name);
     d->timer.setSingleShot(true);
     connect (&d->timer, &QTimer::timeout, this, &BaseJob::timeout);
-    d->retryTimer.setSingleShot(true);
-    connect (&d->retryTimer, &QTimer::timeout, this, &BaseJob::sendRequest);
 }
 
 BaseJob::~BaseJob()
 {
+    // abandon() doesn't delete jobs in the middle of parsing; but a job
+    // deleted directly has to wait for the parser. Classes with data
+    // filled by the parser must wait in their own destructors as well.
+    waitForParser();
     stop();
+    detachConnection();
     qCDebug(d->logCat) << this << "destroyed";
 }
 
@@ -148,6 +282,12 @@ void BaseJob::Private::sendRequest()
     req.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
     req.setMaximumRedirectsAllowed(10);
 #endif
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 8, 0))
+    if (connection->http2Allowed())
+        req.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
+#endif
+    if (!connection->keepAlive())
+        req.setRawHeader("Connection", "close");
     switch( verb )
     {
         case HttpVerb::Get:
@@ -173,13 +313,58 @@ void BaseJob::start(const ConnectionData* connData)
 {
     d->connection = connData;
     beforeStart(connData);
-    sendRequest();
+    connData->jobScheduler()->attach(this);
+    enqueue();
+}
+
+void BaseJob::enqueue()
+{
+    if (!d->connection)
+        return;
+    // The scheduler calls sendRequest() when there's a free slot
+    d->scheduled = true;
+    d->connection->jobScheduler()->enqueue(this);
+}
+
+void BaseJob::releaseSlot()
+{
+    if (d->connection && d->scheduled)
+    {
+        d->scheduled = false;
+        d->connection->jobScheduler()->release(this);
+    }
+}
+
+void BaseJob::detachConnection()
+{
+    if (!d->connection)
+        return;
+
+    releaseSlot();
+    const auto* connection = d->connection;
+    d->connection = nullptr;
+    connection->backoffManager()->cancelRetry(this);
+    connection->jobScheduler()->detach(this);
+}
+
+void BaseJob::connectionGone()
+{
+    // Called by the scheduler of a connection being destroyed; the network
+    // access manager may go away right after, taking the reply with it
+    d->connection = nullptr;
+    d->scheduled = false;
+    d->timer.stop();
+    if (d->reply)
+    {
+        d->reply->disconnect(this);
+        d->reply.reset();
+    }
+    abandon();
 }
 
 void BaseJob::sendRequest()
 {
     emit aboutToStart();
-    d->retryTimer.stop(); // In case we were counting down at the moment
     qCDebug(d->logCat) << this << "sending request to" << d->apiEndpoint;
     if (!d->requestQuery.isEmpty())
         qCDebug(d->logCat) << "  query:" << d->requestQuery.toString();
@@ -198,10 +383,62 @@ void BaseJob::sendRequest()
 
 void BaseJob::gotReply()
 {
+    releaseSlot();
+    // Any HTTP response, even an error, means the server is reachable
+    if (d->reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).isValid())
+        d->connection->backoffManager()->reportSuccess();
+    else
+        d->connection->backoffManager()->reportFailure();
     setStatus(checkReply(d->reply.data()));
+    auto* scheduler = d->connection->jobScheduler();
+    if (error() == TooManyRequestsError)
+        scheduler->reportRateLimited(d->priority, d->retryAfterMs);
+    else if (status().good())
+        scheduler->reportAccepted(d->priority);
     if (status().good())
+    {
+        if (d->parseInBackground)
+        {
+            parseReplyInBackground();
+            return;
+        }
         setStatus(parseReply(d->reply->readAll()));
+    }
+
+    finishJob();
+}
+
+void BaseJob::parseReplyInBackground()
+{
+    // The job shouldn't time out while the reply is being parsed
+    d->timer.stop();
+    d->parserLock.acquire();
+    const auto data = d->reply->readAll();
+    QThreadPool::globalInstance()->start(new ParserTask([this, data] {
+        d->parsedStatus = parseReply(data);
+        // Post the event before releasing the lock, so that the job could not
+        // be destroyed in between; a destroyed job drops its posted events.
+        QMetaObject::invokeMethod(this, "gotParsedReply", Qt::QueuedConnection);
+        d->parserLock.release();
+    }));
+}
+
+void BaseJob::waitForParser()
+{
+    d->parserLock.acquire();
+    d->parserLock.release();
+}
 
+void BaseJob::gotParsedReply()
+{
+    // Make sure the worker thread has let go of the job
+    waitForParser();
+    if (d->abandoned)
+    {
+        deleteLater();
+        return;
+    }
+    setStatus(d->parsedStatus);
     finishJob();
 }
 
@@ -209,6 +446,21 @@ BaseJob::Status BaseJob::checkReply(QNetworkReply* reply) const
 {
     if (reply->error() != QNetworkReply::NoError)
         qCDebug(d->logCat) << this << "returned" << reply->error();
+    d->retryAfterMs = -1;
+    const auto httpCode =
+        reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (httpCode == 429)
+    {
+        // The body should be {"errcode": "M_LIMIT_EXCEEDED", "error": ...,
+        // "retry_after_ms": ...}; retry_after_ms is optional
+        const auto json = QJsonDocument::fromJson(reply->readAll()).object();
+        if (json.contains("retry_after_ms"))
+            d->retryAfterMs = json.value("retry_after_ms").toInt();
+        qCDebug(d->logCat) << this << "is rate limited, retry after"
+                           << d->retryAfterMs << "ms";
+        return { TooManyRequestsError,
+                 json.value("error").toString(reply->errorString()) };
+    }
     switch( reply->error() )
     {
     case QNetworkReply::NoError:
@@ -249,6 +501,7 @@ BaseJob::Status BaseJob::parseJson(const QJsonDocument&)
 void BaseJob::stop()
 {
     d->timer.stop();
+    releaseSlot();
     if (d->reply)
     {
         d->reply->disconnect(this); // Ignore whatever comes from the reply
@@ -258,25 +511,32 @@ void BaseJob::stop()
             d->reply->abort();
         }
     }
-    else
+    else if (d->connection)
         qCWarning(d->logCat) << this << "stopped with empty network reply";
 }
 
 void BaseJob::finishJob()
 {
     stop();
-    if ((error() == NetworkError || error() == TimeoutError)
-            && d->retriesTaken < d->maxRetries)
+    const bool rateLimited = error() == TooManyRequestsError;
+    if (d->connection && (rateLimited
+            ? d->rateLimitedRetries < d->maxRateLimitedRetries
+            : (error() == NetworkError || error() == TimeoutError)
+              && d->retriesTaken < d->maxRetries))
     {
-        // TODO: The whole retrying thing should be put to ConnectionManager
-        // otherwise independently retrying jobs make a bit of notification
-        // storm towards the UI.
-        const auto retryInterval = getNextRetryInterval();
-        ++d->retriesTaken;
-        qCWarning(d->logCat) << this << "will take retry" << d->retriesTaken
+        // The job waits in the connection-wide backoff manager, which
+        // passes it back to the scheduler when it's time to retry;
+        // a rate-limited job waits for as long as the server asked.
+        // Rate limiting says nothing about the job itself, so these
+        // retries are counted separately and don't use up maxRetries().
+        const auto retryNumber =
+                rateLimited ? ++d->rateLimitedRetries : ++d->retriesTaken;
+        const auto retryInterval =
+                d->connection->backoffManager()->scheduleRetry(this,
+                    rateLimited ? d->retryAfterMs : -1);
+        qCWarning(d->logCat) << this << "will take retry" << retryNumber
                    << "in" << retryInterval/1000 << "s";
-        d->retryTimer.start(retryInterval);
-        emit retryScheduled(d->retriesTaken, retryInterval);
+        emit retryScheduled(retryNumber, retryInterval);
         return;
     }
 
@@ -300,13 +560,14 @@ BaseJob::duration_t BaseJob::getCurrentTimeout() const
 
 BaseJob::duration_t BaseJob::getNextRetryInterval() const
 {
-    static const std::array<int, 3> intervals = { 5, 10, 30 };
-    return intervals[std::min(d->retriesTaken, intervals.size() - 1)] * 1000;
+    return d->connection ?
+            d->connection->backoffManager()->nextRetryInterval() : 0;
 }
 
 BaseJob::duration_t BaseJob::millisToRetry() const
 {
-    return d->retryTimer.isActive() ? d->retryTimer.remainingTime() : 0;
+    return d->connection ?
+            d->connection->backoffManager()->millisToRetry(this) : 0;
 }
 
 size_t BaseJob::maxRetries() const
@@ -319,6 +580,16 @@ void BaseJob::setMaxRetries(size_t newMaxRetries)
     d->maxRetries = newMaxRetries;
 }
 
+JobPriority BaseJob::priority() const
+{
+    return d->priority;
+}
+
+void BaseJob::setPriority(JobPriority priority)
+{
+    d->priority = priority;
+}
+
 BaseJob::Status BaseJob::status() const
 {
     return d->status;
@@ -348,14 +619,24 @@ void BaseJob::setStatus(int code, QString message)
 
 void BaseJob::abandon()
 {
+    d->timer.stop();
+    detachConnection();
     this->disconnect();
     if (d->reply)
         d->reply->disconnect(this);
+    // Deleting the job now would make the main thread wait for the parser
+    if (d->parserLock.available() == 0)
+    {
+        d->abandoned = true;
+        return;
+    }
     deleteLater();
 }
 
 void BaseJob::timeout()
 {
+    if (d->connection)
+        d->connection->backoffManager()->reportFailure();
     setStatus( TimeoutError, "The job has timed out" );
     finishJob();
 }
@@ -368,6 +649,11 @@ void BaseJob::sslErrors(const QList<QSslError>& errors)
     d->reply->ignoreSslErrors(); // TODO: insecure! should prompt user first
 }
 
+void BaseJob::setParseInBackground(bool enable)
+{
+    d->parseInBackground = enable;
+}
+
 void BaseJob::setLoggingCategory(LoggingCategory lcf)
 {
     d->logCat = lcf;
@@ -19,6 +19,7 @@
 #pragma once
 
 #include "logging.h"
+#include "jobscheduler.h"
 
 #include <QtCore/QObject>
 #include <QtCore/QJsonDocument>
@@ -51,6 +52,7 @@ namespace QMatrixClient
                 , ContentAccessError
                 , NotFoundError
                 , IncorrectRequestError
+                , TooManyRequestsError //< HTTP 429 (M_LIMIT_EXCEEDED)
                 , UserDefinedError = 200
             };
 
@@ -88,10 +90,8 @@ namespace QMatrixClient
                             insert(i.first, i.second);
                     }
 #endif
-                    QByteArray serialize() const
-                    {
-                        return QJsonDocument(*this).toJson();
-                    }
+                    /** Writes the data as compact JSON for a request body */
+                    QByteArray serialize() const;
             };
 
             /**
@@ -130,6 +130,14 @@ namespace QMatrixClient
             size_t maxRetries() const;
             void setMaxRetries(size_t newMaxRetries);
 
+            /**
+             * The scheduling class of the job, JobPriority::Default unless
+             * the job sets another one; can only be changed before start()
+             * \sa JobScheduler
+             */
+            JobPriority priority() const;
+            void setPriority(JobPriority priority);
+
             Q_INVOKABLE duration_t getCurrentTimeout() const;
             Q_INVOKABLE duration_t getNextRetryInterval() const;
             Q_INVOKABLE duration_t millisToRetry() const;
@@ -250,6 +258,24 @@ namespace QMatrixClient
             void setStatus(Status s);
             void setStatus(int code, QString message);
 
+            /**
+             * Enables or disables parsing of the reply in a thread pool
+             *
+             * When enabled, parseReply() (and therefore parseJson()) is
+             * invoked in a QThreadPool worker thread; the job is finished
+             * and its result signals are emitted in the job's own thread
+             * once parsing is done. Jobs that enable this must not access
+             * anything except their own data from parseReply()/parseJson().
+             * Disabled by default.
+             */
+            void setParseInBackground(bool enable);
+            /**
+             * Blocks until the background parser, if one is running,
+             * is done with the job; destructors of jobs that parse
+             * in background must call this before their data go away
+             */
+            void waitForParser();
+
             // Q_DECLARE_LOGGING_CATEGORY return different function types
             // in different versions
             using LoggingCategory = decltype(JOBS)*;
@@ -264,10 +290,20 @@ namespace QMatrixClient
         private slots:
             void sendRequest();
             void gotReply();
+            void gotParsedReply();
 
         private:
+            friend class JobScheduler;
+            friend class BackoffManager;
+
             void stop();
             void finishJob();
+            void parseReplyInBackground();
+            // Interaction with the JobScheduler and the BackoffManager
+            void enqueue();
+            void releaseSlot();
+            void detachConnection();
+            void connectionGone();
 
             class Private;
             QScopedPointer<Private> d;
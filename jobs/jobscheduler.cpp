@@ -0,0 +1,287 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "jobscheduler.h"
+
+#include "basejob.h"
+
+#include <algorithm>
+
+using namespace QMatrixClient;
+
+// Sync and Send have strict priority; the classes starting from
+// FirstTurnClass take turns
+static const size_t FirstTurnClass = size_t(JobPriority::Default);
+// The rate gained with each accepted request, in requests per second
+static const double RateIncrease = 0.05;
+static const double MinRate = 0.1;
+static const qint64 RateWindow = 10000; // ms
+
+JobScheduler::JobScheduler()
+    : totalLimit(6)
+{
+    jobClass(JobPriority::Sync).limit = 1;
+    jobClass(JobPriority::Send).limit = 4;
+    jobClass(JobPriority::Default).limit = 4;
+    jobClass(JobPriority::Receipt).limit = 2;
+    jobClass(JobPriority::Media).limit = 3;
+    clock.start();
+    wakeUpTimer.setSingleShot(true);
+    QObject::connect(&wakeUpTimer, &QTimer::timeout, [this] { dispatch(); });
+}
+
+JobScheduler::~JobScheduler()
+{
+    wakeUpTimer.stop();
+    for (auto& jc: classes)
+    {
+        jc.queue.clear();
+        jc.running.clear();
+    }
+    // Jobs outlive the connection if nobody abandons them; cut them off
+    // now, while the network access manager of the connection still exists
+    const auto jobs = attachedJobs;
+    attachedJobs.clear();
+    for (auto* job: jobs)
+        job->connectionGone();
+}
+
+void JobScheduler::attach(BaseJob* job)
+{
+    attachedJobs.insert(job);
+}
+
+void JobScheduler::detach(BaseJob* job)
+{
+    release(job);
+    attachedJobs.remove(job);
+}
+
+JobScheduler::JobClass& JobScheduler::jobClass(JobPriority priority)
+{
+    return classes[size_t(priority)];
+}
+
+const JobScheduler::JobClass& JobScheduler::jobClass(JobPriority priority) const
+{
+    return classes[size_t(priority)];
+}
+
+void JobScheduler::enqueue(BaseJob* job)
+{
+    auto& jc = jobClass(job->priority());
+    if (jc.queue.contains(job) || jc.running.contains(job))
+        return;
+
+    jc.queue.push_back(job);
+    dispatch();
+    if (jc.queue.contains(job))
+        qCDebug(JOBS) << job->objectName() << "is queued, queue depth:"
+                      << jc.queue.size();
+}
+
+void JobScheduler::release(BaseJob* job)
+{
+    for (auto& jc: classes)
+    {
+        if (jc.running.remove(job))
+        {
+            dispatch();
+            return;
+        }
+        if (jc.queue.removeOne(job))
+            return;
+    }
+}
+
+bool JobScheduler::canStart(size_t classIdx) const
+{
+    const auto& jc = classes[classIdx];
+    if (jc.queue.empty() || jc.running.size() >= jc.limit)
+        return false;
+    if (jc.pausedUntil > clock.elapsed() || (jc.rate > 0 && jc.tokens < 1))
+        return false;
+    return classIdx == size_t(JobPriority::Sync) ||
+            runningJobs() - runningJobs(JobPriority::Sync) < totalLimit;
+}
+
+void JobScheduler::refillTokens(JobClass& jc, qint64 now)
+{
+    if (jc.rate > 0)
+    {
+        // Allow a burst of at most one second worth of requests
+        jc.tokens = std::min(jc.tokens + jc.rate * (now - jc.lastRefill) / 1000,
+                             std::max(jc.rate, 1.0));
+    }
+    jc.lastRefill = now;
+}
+
+void JobScheduler::dispatch()
+{
+    const auto now = clock.elapsed();
+    for (auto& jc: classes)
+        refillTokens(jc, now);
+    for (;;)
+    {
+        size_t picked = ClassCount;
+        for (size_t i = 0; i < FirstTurnClass; ++i)
+            if (canStart(i))
+            {
+                picked = i;
+                break;
+            }
+        if (picked == ClassCount)
+        {
+            const auto turnClasses = ClassCount - FirstTurnClass;
+            for (size_t i = 0; i < turnClasses; ++i)
+            {
+                const auto idx = FirstTurnClass + (nextTurn + i) % turnClasses;
+                if (canStart(idx))
+                {
+                    picked = idx;
+                    nextTurn = (idx - FirstTurnClass + 1) % turnClasses;
+                    break;
+                }
+            }
+        }
+        if (picked == ClassCount)
+            break;
+
+        auto& jc = classes[picked];
+        if (jc.rate > 0)
+            jc.tokens -= 1;
+        if (now - jc.windowStart > RateWindow)
+        {
+            jc.windowStart = now;
+            jc.recentStarts = 0;
+        }
+        ++jc.recentStarts;
+        auto* job = jc.queue.takeFirst();
+        jc.running.insert(job);
+        job->sendRequest();
+    }
+    scheduleWakeUp(now);
+}
+
+void JobScheduler::scheduleWakeUp(qint64 now)
+{
+    qint64 wakeUpIn = -1;
+    for (const auto& jc: classes)
+    {
+        if (jc.queue.empty() || jc.running.size() >= jc.limit)
+            continue; // Will be dispatched on release() or enqueue()
+
+        qint64 wait = std::max(jc.pausedUntil - now, qint64(0));
+        if (jc.rate > 0 && jc.tokens < 1)
+            wait = std::max(wait, qint64((1 - jc.tokens) * 1000 / jc.rate) + 1);
+        if (wait > 0 && (wakeUpIn < 0 || wait < wakeUpIn))
+            wakeUpIn = wait;
+    }
+    if (wakeUpIn > 0)
+        wakeUpTimer.start(int(wakeUpIn));
+}
+
+int JobScheduler::concurrencyLimit(JobPriority priority) const
+{
+    return jobClass(priority).limit;
+}
+
+void JobScheduler::setConcurrencyLimit(JobPriority priority, int limit)
+{
+    jobClass(priority).limit = std::max(limit, 1);
+    dispatch();
+}
+
+int JobScheduler::totalConcurrencyLimit() const
+{
+    return totalLimit;
+}
+
+void JobScheduler::setTotalConcurrencyLimit(int limit)
+{
+    totalLimit = std::max(limit, 1);
+    dispatch();
+}
+
+double JobScheduler::rateLimit(JobPriority priority) const
+{
+    return jobClass(priority).rate;
+}
+
+void JobScheduler::setRateLimit(JobPriority priority, double requestsPerSecond)
+{
+    auto& jc = jobClass(priority);
+    jc.rate = std::max(requestsPerSecond, 0.0);
+    jc.tokens = std::min(jc.tokens, std::max(jc.rate, 1.0));
+    dispatch();
+}
+
+void JobScheduler::reportAccepted(JobPriority priority)
+{
+    auto& jc = jobClass(priority);
+    if (jc.rate > 0)
+        jc.rate += RateIncrease;
+}
+
+void JobScheduler::reportRateLimited(JobPriority priority, int retryAfterMs)
+{
+    if (priority == JobPriority::Sync)
+        return;
+
+    auto& jc = jobClass(priority);
+    const auto now = clock.elapsed();
+    if (jc.rate > 0)
+        jc.rate /= 2;
+    else
+    {
+        const auto window = std::max(now - jc.windowStart, qint64(1000));
+        jc.rate = jc.recentStarts * 1000.0 / window / 2;
+    }
+    jc.rate = std::max(jc.rate, MinRate);
+    jc.tokens = 0;
+    jc.lastRefill = now;
+    jc.pausedUntil = std::max(jc.pausedUntil, now + retryAfterMs);
+    qCWarning(JOBS) << "Rate limited by the server; limiting job class"
+                    << int(priority) << "to" << jc.rate << "request(s)/s";
+}
+
+int JobScheduler::queueDepth(JobPriority priority) const
+{
+    return jobClass(priority).queue.size();
+}
+
+int JobScheduler::queueDepth() const
+{
+    int result = 0;
+    for (const auto& jc: classes)
+        result += jc.queue.size();
+    return result;
+}
+
+int JobScheduler::runningJobs(JobPriority priority) const
+{
+    return jobClass(priority).running.size();
+}
+
+int JobScheduler::runningJobs() const
+{
+    int result = 0;
+    for (const auto& jc: classes)
+        result += jc.running.size();
+    return result;
+}
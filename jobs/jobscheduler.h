@@ -0,0 +1,148 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include <QtCore/QList>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+#include <QtCore/QElapsedTimer>
+
+#include <array>
+
+namespace QMatrixClient
+{
+    class BaseJob;
+
+    /**
+     * Classes of jobs for scheduling; Sync and Send jobs are dispatched
+     * strictly before others, the remaining classes take turns
+     */
+    enum class JobPriority : unsigned
+    {
+        Sync,    //< The long-polling sync
+        Send,    //< User-initiated sending of events and room state
+        Default, //< Everything not classified otherwise
+        Receipt, //< Read receipts
+        Media    //< Downloads of thumbnails and media
+    };
+
+    /**
+     * A per-connection queue of network requests
+     *
+     * BaseJob::start() and job retries go through the scheduler, which
+     * sends the request right away if the job's class is within its limit
+     * of concurrently running requests, or queues it otherwise. Within
+     * a class, jobs are started in the order of queueing. Apart from
+     * per-class limits, all classes except Sync share a limit on the total
+     * number of concurrent requests (the sync request is long-polling and
+     * should never wait for others).
+     *
+     * Classes other than Sync can also be rate-limited with a token bucket.
+     * The rate adapts to the server: it is cut by half each time the server
+     * rejects a request of the class with HTTP 429, and the class is
+     * paused for the time the server asks for; every accepted request
+     * raises the rate a little. A class starts without a rate limit until
+     * the first rejection, when the limit is set to half of its recently
+     * observed rate.
+     */
+    class JobScheduler
+    {
+        public:
+            JobScheduler();
+            /** Detaches and abandons all jobs still attached, see attach() */
+            ~JobScheduler();
+
+            /**
+             * Registers a started job with the scheduler. Jobs stay attached
+             * until detach(); those still attached when the scheduler
+             * (that is, the connection) is destroyed get abandoned, with
+             * their network replies deleted right away.
+             */
+            void attach(BaseJob* job);
+            /** Removes the job from the queue and forgets about it */
+            void detach(BaseJob* job);
+
+            /** Queues the job and starts as many queued jobs as possible */
+            void enqueue(BaseJob* job);
+            /**
+             * Notifies the scheduler that the request of the job is over
+             * (or will not be sent, if the job is still in the queue)
+             */
+            void release(BaseJob* job);
+
+            int concurrencyLimit(JobPriority priority) const;
+            void setConcurrencyLimit(JobPriority priority, int limit);
+            int totalConcurrencyLimit() const;
+            void setTotalConcurrencyLimit(int limit);
+
+            /** Requests per second allowed for the class; 0 means no limit */
+            double rateLimit(JobPriority priority) const;
+            void setRateLimit(JobPriority priority, double requestsPerSecond);
+
+            /** A request of the class has been accepted by the server */
+            void reportAccepted(JobPriority priority);
+            /**
+             * The server has rejected a request of the class because of
+             * rate limiting and asked to wait for retryAfterMs
+             */
+            void reportRateLimited(JobPriority priority, int retryAfterMs);
+
+            /** The number of jobs of the class waiting in the queue */
+            int queueDepth(JobPriority priority) const;
+            /** The number of jobs waiting in the queue */
+            int queueDepth() const;
+            /** The number of jobs of the class with requests in flight */
+            int runningJobs(JobPriority priority) const;
+            /** The number of jobs with requests in flight */
+            int runningJobs() const;
+
+        private:
+            struct JobClass
+            {
+                QList<BaseJob*> queue;
+                QSet<BaseJob*> running;
+                int limit;
+
+                // Token bucket; all times are on the scheduler's clock
+                double rate = 0; // tokens per second, 0 means no limit
+                double tokens = 0;
+                qint64 lastRefill = 0;
+                qint64 pausedUntil = 0;
+                // Requests started since windowStart, to measure the rate
+                int recentStarts = 0;
+                qint64 windowStart = 0;
+            };
+            static const size_t ClassCount = size_t(JobPriority::Media) + 1;
+            std::array<JobClass, ClassCount> classes;
+            QSet<BaseJob*> attachedJobs;
+            int totalLimit;
+            // The class to be looked at first among the ones taking turns
+            size_t nextTurn = 0;
+            QElapsedTimer clock;
+            // Wakes up the dispatching when a rate-limited class gets a token
+            QTimer wakeUpTimer;
+
+            JobClass& jobClass(JobPriority priority);
+            const JobClass& jobClass(JobPriority priority) const;
+            bool canStart(size_t classIdx) const;
+            void refillTokens(JobClass& jc, qint64 now);
+            void dispatch();
+            void scheduleWakeUp(qint64 now);
+    };
+}  // namespace QMatrixClient
@@ -34,7 +34,9 @@ MediaThumbnailJob::MediaThumbnailJob(QUrl url, QSize requestedSize,
                 , { "method",
                     thumbnailType == ThumbnailType::Scale ? "scale" : "crop" }
                 }))
-{ }
+{
+    setPriority(JobPriority::Media);
+}
 
 QPixmap MediaThumbnailJob::thumbnail() const
 {
@@ -24,4 +24,6 @@ PostReceiptJob::PostReceiptJob(const QString& roomId, const QString& eventId)
     : BaseJob(HttpVerb::Post, "PostReceiptJob",
               QStringLiteral("/_matrix/client/r0/rooms/%1/receipt/m.read/%2")
                   .arg(roomId, eventId))
-{ }
+{
+    setPriority(JobPriority::Receipt);
+}
@@ -35,7 +35,9 @@ namespace QMatrixClient
                               .arg(roomId, EvT::TypeId), // See also beforeStart()
                           Query(),
                           Data(event.toJson()))
-            { }
+            {
+                setPriority(JobPriority::Send);
+            }
 
             /**
              * Constructs a plain text message job (for compatibility with
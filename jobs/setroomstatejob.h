@@ -39,7 +39,9 @@ namespace QMatrixClient
                               .arg(roomId, EvT::TypeId, stateKey),
                           Query(),
                           Data(event.toJson()))
-            { }
+            {
+                setPriority(JobPriority::Send);
+            }
             /**
              * Constructs a job that sets a state using an arbitrary room event
              * without a state key.
@@ -51,7 +53,9 @@ namespace QMatrixClient
                               .arg(roomId, EvT::TypeId),
                           Query(),
                           Data(event.toJson()))
-            { }
+            {
+                setPriority(JobPriority::Send);
+            }
 
             QString eventId() const { return _eventId; }
 
@@ -19,6 +19,9 @@
 #include "syncjob.h"
 
 #include <QtCore/QElapsedTimer>
+#include <QtCore/QStringBuilder>
+
+#include <algorithm>
 
 using namespace QMatrixClient;
 
@@ -30,6 +33,7 @@ SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
               QStringLiteral("_matrix/client/r0/sync"))
 {
     setLoggingCategory(SYNCJOB);
+    setPriority(JobPriority::Sync);
     QUrlQuery query;
     if( !filter.isEmpty() )
         query.addQueryItem("filter", filter);
@@ -42,6 +46,15 @@ SyncJob::SyncJob(const QString& since, const QString& filter, int timeout,
     setRequestQuery(query);
 
     setMaxRetries(std::numeric_limits<int>::max());
+    // Initial syncs can be tens of megabytes; keep the event loop responsive
+    // while the response is being turned into events.
+    setParseInBackground(true);
+}
+
+SyncJob::~SyncJob()
+{
+    // The parser fills d from a worker thread
+    waitForParser();
 }
 
 QString SyncData::nextBatch() const
@@ -54,14 +67,265 @@ SyncDataList&& SyncData::takeRoomData()
     return std::move(roomData);
 }
 
+BaseJob::Status SyncJob::parseReply(QByteArray data)
+{
+    return d.parseReply(data);
+}
+
 BaseJob::Status SyncJob::parseJson(const QJsonDocument& data)
 {
     return d.parseJson(data);
 }
 
+namespace
+{
+    /**
+     * A minimal forward-only scanner over JSON text
+     *
+     * The scanner only understands the structure of JSON well enough to walk
+     * through object keys and to find the boundaries of values; the values
+     * themselves are left to QJsonDocument. The scanned data should stay
+     * intact for the lifetime of the scanner.
+     */
+    class JsonScanner
+    {
+        public:
+            explicit JsonScanner(const QByteArray& data)
+                : begin(data.constBegin()), pos(begin), end(data.constEnd())
+            { }
+
+            bool atEnd()
+            {
+                skipWhitespace();
+                return pos == end;
+            }
+
+            int offset() const { return int(pos - begin); }
+
+            bool consume(char c)
+            {
+                skipWhitespace();
+                if (pos == end || *pos != c)
+                    return false;
+                ++pos;
+                return true;
+            }
+
+            bool readString(QString* s);
+
+            /**
+             * Moves the position past the value at the current position,
+             * returning the slice of the text occupied by the value
+             * in \p valueText, if it is not nullptr
+             */
+            bool skipValue(QByteArray* valueText = nullptr);
+
+            /**
+             * Walks through an object at the current position, invoking
+             * \p f for each key; \p f must consume the respective value and
+             * return false if it couldn't do that.
+             */
+            template <typename FnT>
+            bool forEachKey(FnT f)
+            {
+                if (!consume('{'))
+                    return false;
+                if (consume('}'))
+                    return true;
+                do {
+                    QString key;
+                    if (!readString(&key) || !consume(':') || !f(key))
+                        return false;
+                } while (consume(','));
+                return consume('}');
+            }
+
+        private:
+            const char* begin;
+            const char* pos;
+            const char* end;
+
+            void skipWhitespace()
+            {
+                while (pos != end &&
+                        (*pos == ' ' || *pos == '\n' || *pos == '\r' || *pos == '\t'))
+                    ++pos;
+            }
+    };
+
+    bool JsonScanner::readString(QString* s)
+    {
+        if (!consume('"'))
+            return false;
+
+        s->clear();
+        auto segmentBegin = pos;
+        for (; pos != end; ++pos)
+        {
+            if (*pos == '"')
+            {
+                s->append(QString::fromUtf8(segmentBegin, int(pos - segmentBegin)));
+                ++pos;
+                return true;
+            }
+            if (*pos != '\\')
+                continue;
+
+            s->append(QString::fromUtf8(segmentBegin, int(pos - segmentBegin)));
+            if (++pos == end)
+                return false;
+            switch (*pos)
+            {
+                case '"': case '\\': case '/':
+                    s->append(QLatin1Char(*pos)); break;
+                case 'b': s->append(QLatin1Char('\b')); break;
+                case 'f': s->append(QLatin1Char('\f')); break;
+                case 'n': s->append(QLatin1Char('\n')); break;
+                case 'r': s->append(QLatin1Char('\r')); break;
+                case 't': s->append(QLatin1Char('\t')); break;
+                case 'u': {
+                    if (end - pos < 5)
+                        return false;
+                    bool ok = false;
+                    // Surrogate pairs come as two \u sequences; since QString
+                    // stores UTF-16, appending code units one by one is enough.
+                    const auto code = QByteArray(pos + 1, 4).toUShort(&ok, 16);
+                    if (!ok)
+                        return false;
+                    s->append(QChar(code));
+                    pos += 4;
+                    break;
+                }
+                default:
+                    return false;
+            }
+            segmentBegin = pos + 1;
+        }
+        return false;
+    }
+
+    bool JsonScanner::skipValue(QByteArray* valueText)
+    {
+        skipWhitespace();
+        const auto valueBegin = pos;
+        int depth = 0;
+        bool inString = false;
+        for (; pos != end; ++pos)
+        {
+            const char c = *pos;
+            if (inString)
+            {
+                if (c == '\\')
+                {
+                    if (++pos == end)
+                        return false;
+                }
+                else if (c == '"')
+                {
+                    inString = false;
+                    if (depth == 0)
+                    {
+                        ++pos;
+                        break;
+                    }
+                }
+                continue;
+            }
+            if (c == '"')
+                inString = true;
+            else if (c == '{' || c == '[')
+                ++depth;
+            else if (c == '}' || c == ']')
+            {
+                if (depth == 0) // The end of a scalar value
+                    break;
+                if (--depth == 0)
+                {
+                    ++pos;
+                    break;
+                }
+            }
+            else if (depth == 0 && (c == ',' || c == ' ' || c == '\n' ||
+                                    c == '\r' || c == '\t'))
+                break;
+        }
+        if (depth != 0 || inString || pos == valueBegin)
+            return false;
+
+        if (valueText)
+            *valueText = QByteArray::fromRawData(valueBegin,
+                                                 int(pos - valueBegin));
+        return true;
+    }
+}
+
+BaseJob::Status SyncData::parseReply(const QByteArray& data)
+{
+    QElapsedTimer et; et.start();
+    const auto allocsBefore = Event::allocationStats();
+
+    JsonScanner scanner { data };
+    QString parseError;
+    const auto parseRoom = [&] (const QString& roomId, JoinState joinState) -> bool
+    {
+        QByteArray roomText;
+        if (!scanner.skipValue(&roomText))
+            return false;
+
+        QJsonParseError error;
+        const auto roomJson = QJsonDocument::fromJson(roomText, &error);
+        if (error.error != QJsonParseError::NoError)
+        {
+            parseError = "room " % roomId % ": " % error.errorString();
+            return false;
+        }
+        roomData.emplace_back(roomId, joinState, roomJson.object());
+        return true;
+    };
+    const auto parseRooms = [&] (const QString& joinStateKey) -> bool
+    {
+        const auto it = std::find(JoinStateStrings.begin(),
+                                  JoinStateStrings.end(), joinStateKey);
+        if (it == JoinStateStrings.end())
+            return scanner.skipValue();
+
+        const auto joinState = JoinState(it - JoinStateStrings.begin());
+        return scanner.forEachKey([&] (const QString& roomId) {
+            return parseRoom(roomId, joinState);
+        });
+    };
+    const bool parsed = scanner.forEachKey([&] (const QString& key) -> bool
+    {
+        // TODO: presence
+        // TODO: account_data
+        if (key == "next_batch")
+            return scanner.readString(&nextBatch_);
+        if (key == "rooms")
+            return scanner.forEachKey(parseRooms);
+        return scanner.skipValue();
+    }) && scanner.atEnd();
+    if (!parsed)
+    {
+        if (parseError.isEmpty())
+            parseError = QStringLiteral("Malformed JSON at offset %1")
+                            .arg(scanner.offset());
+        return { BaseJob::JsonParseError, parseError };
+    }
+
+    const auto allocsAfter = Event::allocationStats();
+    qCDebug(PROFILER) << "*** SyncData::parseReply():" << et.elapsed() << "ms,"
+                      << roomData.size() << "room(s),"
+                      << allocsAfter.events - allocsBefore.events << "event(s),"
+                      << allocsAfter.systemAllocations
+                         - allocsBefore.systemAllocations
+                      << "heap allocation(s) for events";
+    return BaseJob::Success;
+}
+
 BaseJob::Status SyncData::parseJson(const QJsonDocument &data)
 {
     QElapsedTimer et; et.start();
+    const auto allocsBefore = Event::allocationStats();
 
     QJsonObject json = data.object();
     nextBatch_ = json.value("next_batch").toString();
@@ -78,7 +342,12 @@ BaseJob::Status SyncData::parseJson(const QJsonDocument &data)
             roomData.emplace_back(roomIt.key(), JoinState(i),
                                   roomIt.value().toObject());
     }
-    qCDebug(PROFILER) << "*** SyncData::parseJson():" << et.elapsed() << "ms";
+    const auto allocsAfter = Event::allocationStats();
+    qCDebug(PROFILER) << "*** SyncData::parseJson():" << et.elapsed() << "ms,"
+                      << allocsAfter.events - allocsBefore.events << "event(s),"
+                      << allocsAfter.systemAllocations
+                         - allocsBefore.systemAllocations
+                      << "heap allocation(s) for events";
     return BaseJob::Success;
 }
 
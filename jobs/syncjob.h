@@ -72,6 +72,18 @@ namespace QMatrixClient
     {
         public:
             BaseJob::Status parseJson(const QJsonDocument &data);
+            /**
+             * Parses a raw /sync response without building a QJsonDocument
+             * for the whole response
+             *
+             * The response is walked through with a lightweight scanner that
+             * only looks at the structure of JSON text; each room object is
+             * cut out of the text and parsed on its own, so at most one room
+             * is held in the DOM form at any moment.
+             *
+             * @param data raw contents of the /sync response
+             */
+            BaseJob::Status parseReply(const QByteArray& data);
             SyncDataList&& takeRoomData();
             QString nextBatch() const;
 
@@ -86,10 +98,12 @@ namespace QMatrixClient
             explicit SyncJob(const QString& since = {},
                              const QString& filter = {},
                              int timeout = -1, const QString& presence = {});
+            ~SyncJob() override;
 
             SyncData &&takeData() { return std::move(d); }
 
         protected:
+            Status parseReply(QByteArray data) override;
             Status parseJson(const QJsonDocument& data) override;
 
         private:
@@ -6,7 +6,10 @@ INCLUDEPATH += $$PWD
 HEADERS += \
     $$PWD/connectiondata.h \
     $$PWD/connection.h \
+    $$PWD/statecache.h \
     $$PWD/room.h \
+    $$PWD/eventstore.h \
+    $$PWD/eventidindex.h \
     $$PWD/user.h \
     $$PWD/avatar.h \
     $$PWD/util.h \
@@ -19,6 +22,8 @@ HEADERS += \
     $$PWD/events/typingevent.h \
     $$PWD/events/receiptevent.h \
     $$PWD/jobs/basejob.h \
+    $$PWD/jobs/jobscheduler.h \
+    $$PWD/jobs/backoffmanager.h \
     $$PWD/jobs/checkauthmethods.h \
     $$PWD/jobs/passwordlogin.h \
     $$PWD/jobs/sendeventjob.h \
@@ -35,7 +40,10 @@ HEADERS += \
 SOURCES += \
     $$PWD/connectiondata.cpp \
     $$PWD/connection.cpp \
+    $$PWD/statecache.cpp \
     $$PWD/room.cpp \
+    $$PWD/eventstore.cpp \
+    $$PWD/eventidindex.cpp \
     $$PWD/user.cpp \
     $$PWD/avatar.cpp \
     $$PWD/events/event.cpp \
@@ -45,6 +53,8 @@ SOURCES += \
     $$PWD/events/typingevent.cpp \
     $$PWD/events/receiptevent.cpp \
     $$PWD/jobs/basejob.cpp \
+    $$PWD/jobs/jobscheduler.cpp \
+    $$PWD/jobs/backoffmanager.cpp \
     $$PWD/jobs/checkauthmethods.cpp \
     $$PWD/jobs/passwordlogin.cpp \
     $$PWD/jobs/sendeventjob.cpp \
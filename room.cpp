@@ -33,25 +33,36 @@
 #include "jobs/postreceiptjob.h"
 #include "avatar.h"
 #include "connection.h"
+#include "eventstore.h"
+#include "eventidindex.h"
 #include "user.h"
 
 #include <QtCore/QHash>
+#include <QtCore/QDir>
+#include <QtCore/QCollatorSortKey>
 #include <QtCore/QStringBuilder> // for efficient string concats (operator%)
 #include <QtCore/QElapsedTimer>
 
 #include <array>
+#include <algorithm>
 
 using namespace QMatrixClient;
 
 class Room::Private
 {
     public:
+        /** Map of user ids to users */
+        typedef QHash<QString, User*> members_map_t;
         /** Map of user names to users. User names potentially duplicate, hence a multi-hashmap. */
-        typedef QMultiHash<QString, User*> members_map_t;
+        typedef QMultiHash<QString, User*> member_names_map_t;
         typedef std::pair<rev_iter_t, rev_iter_t> rev_iter_pair_t;
 
         Private(Connection* c, QString id_, JoinState initialJoinState)
-            : q(nullptr), connection(c), id(std::move(id_))
+            : q(nullptr), connection(c)
+            , eventsIndex([this] (TimelineItem::index_t i) -> const QString& {
+                return timeline[size_t(i - timeline.front().index())]->id();
+            })
+            , id(std::move(id_))
             , avatar(c), joinState(initialJoinState), unreadMessages(false)
             , highlightCount(0), notificationCount(0), roomMessagesJob(nullptr)
         { }
@@ -61,11 +72,26 @@ class Room::Private
         // This updates the room displayname field (which is the way a room
         // should be shown in the room list) It should be called whenever the
         // list of members or the room name (m.room.name) or canonical alias change.
+        // Does nothing unless displaynameDirty is set (see notifyChanges()).
         void updateDisplayname();
 
         Connection* connection;
         Timeline timeline;
-        QHash<QString, TimelineItem::index_t> eventsIndex;
+        /**
+         * Incrementally maintained counters for each timeline item, stored
+         * in a deque parallel to the timeline. Both counters are offset by
+         * an arbitrary constant and only make sense compared to each other.
+         */
+        struct ItemStats
+        {
+            /** The number of notable events before this item */
+            int notableBefore;
+            /** The number of sender changes up to this item; same-sender
+             * runs of events have equal values */
+            int senderRun;
+        };
+        std::deque<ItemStats> timelineStats;
+        EventIdIndex eventsIndex;
         QString id;
         QStringList aliases;
         QString canonicalAlias;
@@ -78,11 +104,70 @@ class Room::Private
         int highlightCount;
         int notificationCount;
         members_map_t membersMap;
+        // Secondary index of members by name, used for disambiguation
+        member_names_map_t membersByName;
+        // Two members other than the local user with the lowest ids,
+        // maintained by addMember() and removeMember(); see
+        // roomNameFromMemberNames() for usage.
+        std::array<User*, 2> firstTwoMembers { { nullptr, nullptr } };
+        // Set whenever anything the room displayname is calculated from
+        // changes, see notifyChanges()
+        bool displaynameDirty = true;
+
+        /** A disambiguated member name and its collation key for sorting */
+        struct MemberName
+        {
+            QString name;
+            QCollatorSortKey sortKey;
+        };
+        // Cache of names for members of the room; an entry is dropped
+        // whenever the member or any of its namesakes join, leave or get
+        // renamed (see insertMemberIntoMap() and removeMemberFromMap()).
+        mutable QHash<const User*, MemberName> memberNames;
+        MemberName memberName(User* u) const;
+        QString disambiguatedName(User* u) const;
+        void dropCachedNames(const QString& username);
+        // Members sorted with MemberSorter; kept in order by addMember(),
+        // removeMember() and renameMember() as member names change.
+        QList<User*> sortedMembers;
+        // The collation keys members were put into sortedMembers with;
+        // unlike memberNames, these are kept until the member is moved,
+        // so a member can be found even after its name has changed.
+        QHash<const User*, QCollatorSortKey> sortedMemberKeys;
+        int sortedLowerBound(const QCollatorSortKey& key, User* u) const;
+        int findSortedMember(User* u) const;
+        void insertSortedMember(User* u);
+        void removeSortedMember(int index);
+        void resortMember(User* u, int oldIndex);
         QList<User*> usersTyping;
         QList<User*> membersLeft;
         QHash<const User*, QString> lastReadEventIds;
         QString prevBatch;
         RoomMessagesJob* roomMessagesJob;
+        // The local store of timeline events, opened by openEventStore()
+        std::unique_ptr<EventStore> eventStore;
+        // The index given to the first event added to an empty timeline
+        TimelineItem::index_t baseIndex = 0;
+        int timelineBudget = 0;
+        int evictedEvents = 0;
+        // Set when events have been evicted with no local store to reload
+        // them from, making prevBatch useless
+        bool historyEvicted = false;
+        // Set while updateData() processes ephemeral events; receipt events
+        // are collected to pendingReceipts and applied in one go afterwards.
+        bool collectingReceipts = false;
+        std::vector<ReceiptEvent*> pendingReceipts;
+        // Changes are collected here while the room is being updated from
+        // a sync, to be emitted at once in the end.
+        bool updatingData = false;
+        Changes pendingChanges = NoChange;
+        // Set while receipts are processed in a batch; setLastReadEvent()
+        // collects users to readersChanged instead of emitting signals.
+        bool batchingReceipts = false;
+        QList<User*> readersChanged;
+        // Whether anything that goes to toJson() has changed since the room
+        // was last saved to the state cache; new rooms are never saved yet.
+        bool stateDirty = true;
 
         // Convenience methods to work with the membersMap and usersLeft.
         // addMember() and removeMember() emit respective Room:: signals
@@ -97,21 +182,44 @@ class Room::Private
 
         void getPreviousContent(int limit = 10);
 
+        /**
+         * Opens the local event store of the room, if timeline caching is
+         * enabled, and loads the most recent events from it into an empty
+         * timeline.
+         * @return the event store or nullptr if timeline caching is disabled
+         * or the store couldn't be opened
+         */
+        EventStore* openEventStore();
+        /**
+         * Drops the events in the local store (if there's any) because
+         * the server has sent a limited timeline that doesn't continue
+         * them; the history is requested from newPrevBatch instead.
+         */
+        void dropStoredTimeline(const QString& newPrevBatch);
+
         bool isEventNotable(const RoomEvent* e) const
         {
             return e->senderId() != connection->userId() &&
                     e->type() == EventType::RoomMessage;
         }
+        /** The number of notable events from the iterator to the end */
+        int notableEventsFrom(Timeline::const_iterator from) const;
+        /**
+         * Finds the first event not sent by senderId, starting from
+         * the iterator; O(log n) by bisecting the sender runs
+         */
+        Timeline::const_iterator firstEventNotBy(Timeline::const_iterator from,
+                                                 const QString& senderId) const;
 
         void appendEvent(RoomEvent* e)
         {
             insertEvent(e, timeline.end(),
-                        timeline.empty() ? 0 : q->maxTimelineIndex() + 1);
+                        timeline.empty() ? baseIndex : q->maxTimelineIndex() + 1);
         }
         void prependEvent(RoomEvent* e)
         {
             insertEvent(e, timeline.begin(),
-                        timeline.empty() ? 0 : q->minTimelineIndex() - 1);
+                        timeline.empty() ? baseIndex : q->minTimelineIndex() - 1);
         }
 
         /**
@@ -119,7 +227,22 @@ class Room::Private
          */
         void dropDuplicateEvents(RoomEvents* events) const;
 
+        /**
+         * Records changes and, unless the room is being updated from a sync,
+         * emits respective signals immediately (see Room::changed())
+         */
+        void notifyChanges(Changes changes);
+        void emitPendingChanges();
+
         void setLastReadEvent(User* u, const QString& eventId);
+        /**
+         * Applies read receipts from a batch of receipt events: collapses
+         * them to the newest marker per user, promotes the markers in one
+         * pass and emits lastReadEventsChanged() and readMarkerMoved()
+         * at most once. Of the per-user lastReadEventChanged(), only
+         * the one for the local user is emitted.
+         */
+        void processReceipts(const std::vector<ReceiptEvent*>& receiptEvents);
         rev_iter_pair_t promoteReadMarker(User* u, rev_iter_t newMarker,
                                           bool force = false);
 
@@ -127,7 +250,11 @@ class Room::Private
 
     private:
         QString calculateDisplayname() const;
-        QString roomNameFromMemberNames(const QList<User*>& userlist) const;
+        QString roomNameFromMemberNames(const std::array<User*, 2>& firstTwo,
+                                        int usersCount) const;
+        template <typename ContT>
+        std::array<User*, 2> findFirstTwo(const ContT& users) const;
+        void trackFirstTwo(std::array<User*, 2>& firstTwo, User* u) const;
 
         void insertMemberIntoMap(User* u);
         void removeMemberFromMap(const QString& username, User* u);
@@ -217,17 +344,26 @@ void Room::setJoinState(JoinState state)
     if( state == oldState )
         return;
     d->joinState = state;
+    d->stateDirty = true;
     qCDebug(MAIN) << "Room" << id() << "changed state: "
                   << int(oldState) << "->" << int(state);
     emit joinStateChanged(oldState, state);
+    d->notifyChanges(JoinStateChange);
 }
 
 void Room::Private::setLastReadEvent(User* u, const QString& eventId)
 {
     lastReadEventIds.insert(u, eventId);
+    if (isLocalUser(u))
+        stateDirty = true;
+    if (batchingReceipts)
+    {
+        readersChanged.push_back(u);
+        return;
+    }
     emit q->lastReadEventChanged(u);
     if (isLocalUser(u))
-        emit q->readMarkerMoved();
+        notifyChanges(ReadMarkerChange);
 }
 
 Room::Private::rev_iter_pair_t
@@ -245,21 +381,19 @@ Room::Private::promoteReadMarker(User* u, Room::rev_iter_t newMarker,
 
     // Try to auto-promote the read marker over the user's own messages
     // (switch to direct iterators for that).
-    auto eagerMarker = find_if(newMarker.base(), timeline.cend(),
-          [=](const TimelineItem& ti) { return ti->senderId() != u->id(); });
+    auto eagerMarker = firstEventNotBy(newMarker.base(), u->id());
 
     setLastReadEvent(u, (*(eagerMarker - 1))->id());
     if (isLocalUser(u) && unreadMessages)
     {
-        auto stillUnreadMessagesCount =
-            count_if(eagerMarker, timeline.cend(),
-                 [=](const TimelineItem& ti) { return isEventNotable(ti.event()); });
+        auto stillUnreadMessagesCount = notableEventsFrom(eagerMarker);
 
         if (stillUnreadMessagesCount == 0)
         {
             unreadMessages = false;
+            stateDirty = true;
             qCDebug(MAIN) << "Room" << displayname << "has no more unread messages";
-            emit q->unreadMessagesChanged(q);
+            notifyChanges(UnreadMessagesChange);
         } else
             qCDebug(MAIN) << "Room" << displayname << "still has"
                           << stillUnreadMessagesCount << "unread message(s)";
@@ -270,6 +404,31 @@ Room::Private::promoteReadMarker(User* u, Room::rev_iter_t newMarker,
     return { prevMarker, newMarker };
 }
 
+int Room::Private::notableEventsFrom(Timeline::const_iterator from) const
+{
+    if (from == timeline.cend())
+        return 0;
+    const auto& lastStats = timelineStats.back();
+    return lastStats.notableBefore + isEventNotable(timeline.back().event())
+            - timelineStats[size_t(from - timeline.cbegin())].notableBefore;
+}
+
+Room::Timeline::const_iterator
+Room::Private::firstEventNotBy(Timeline::const_iterator from,
+                               const QString& senderId) const
+{
+    if (from == timeline.cend() || (*from)->senderId() != senderId)
+        return from;
+
+    // Skip the whole run of events by the same sender
+    const auto pos = from - timeline.cbegin();
+    const auto runEnd =
+        std::upper_bound(timelineStats.cbegin() + pos, timelineStats.cend(),
+            timelineStats[size_t(pos)].senderRun,
+            [] (int run, const ItemStats& s) { return run < s.senderRun; });
+    return timeline.cbegin() + (runEnd - timelineStats.cbegin());
+}
+
 void Room::markMessagesAsRead(Room::rev_iter_t upToMarker)
 {
     Private::rev_iter_pair_t markers = d->promoteReadMarker(localUser(), upToMarker);
@@ -335,9 +494,9 @@ Room::rev_iter_t Room::findInTimeline(TimelineItem::index_t index) const
 
 Room::rev_iter_t Room::findInTimeline(const QString& evtId) const
 {
-    if (!d->timeline.empty() && d->eventsIndex.contains(evtId))
-        return findInTimeline(d->eventsIndex.value(evtId));
-    return timelineEdge();
+    const auto index = d->eventsIndex.find(evtId);
+    return index != EventIdIndex::NoIndex ? findInTimeline(index)
+                                          : timelineEdge();
 }
 
 Room::rev_iter_t Room::readMarker(const User* user) const
@@ -366,7 +525,8 @@ void Room::resetNotificationCount()
     if( d->notificationCount == 0 )
         return;
     d->notificationCount = 0;
-    emit notificationCountChanged(this);
+    d->stateDirty = true;
+    d->notifyChanges(NotificationCountChange);
 }
 
 int Room::highlightCount() const
@@ -379,7 +539,8 @@ void Room::resetHighlightCount()
     if( d->highlightCount == 0 )
         return;
     d->highlightCount = 0;
-    emit highlightCountChanged(this);
+    d->stateDirty = true;
+    d->notifyChanges(HighlightCountChange);
 }
 
 QList< User* > Room::usersTyping() const
@@ -406,6 +567,11 @@ QStringList Room::memberNames() const
     return res;
 }
 
+const QList<User*>& Room::sortedMembers() const
+{
+    return d->sortedMembers;
+}
+
 int Room::memberCount() const
 {
     return d->membersMap.size();
@@ -416,25 +582,88 @@ int Room::timelineSize() const
     return int(d->timeline.size());
 }
 
+int Room::evictedEventsCount() const
+{
+    return d->evictedEvents;
+}
+
+int Room::timelineBudget() const
+{
+    return d->timelineBudget;
+}
+
+void Room::setTimelineBudget(int maxEvents)
+{
+    d->timelineBudget = std::max(maxEvents, 0);
+}
+
+int Room::evictOldestEvents(int keepEvents)
+{
+    keepEvents = std::max(keepEvents, 1);
+    if (timelineSize() <= keepEvents)
+        return 0;
+
+    const auto count = timelineSize() - keepEvents;
+    // A pending history request continues from the current front of
+    // the timeline; its result won't fit in front of the new one
+    if (d->roomMessagesJob)
+    {
+        d->roomMessagesJob->abandon();
+        d->roomMessagesJob = nullptr;
+    }
+    emit aboutToEvictMessages(count);
+    const auto evictedEnd = d->timeline.begin() + count;
+    for (auto it = d->timeline.begin(); it != evictedEnd; ++it)
+        d->eventsIndex.remove((*it)->id());
+    d->timeline.erase(d->timeline.begin(), evictedEnd);
+    d->timelineStats.erase(d->timelineStats.begin(),
+                           d->timelineStats.begin() + count);
+    d->evictedEvents += count;
+    if (!d->eventStore)
+        d->historyEvicted = true;
+    qCDebug(MAIN) << "Evicted" << count << "event(s) from room" << id()
+                  << "timeline; the oldest event is now" << d->timeline.front();
+    emit evictedMessages();
+    d->notifyChanges(TimelineChange);
+    return count;
+}
+
 void Room::Private::insertMemberIntoMap(User *u)
 {
-    auto namesakes = membersMap.values(u->name());
-    membersMap.insert(u->name(), u);
+    User* namesake = membersByName.count(u->name()) == 1 ?
+                        membersByName.value(u->name()) : nullptr;
+    const int namesakeIndex = namesake ? findSortedMember(namesake) : -1;
+    dropCachedNames(u->name());
+    membersMap.insert(u->id(), u);
+    membersByName.insert(u->name(), u);
     // If there is exactly one namesake of the added user, signal member renaming
     // for that other one because the two should be disambiguated now.
-    if (namesakes.size() == 1)
-        emit q->memberRenamed(namesakes[0]);
+    if (namesake)
+    {
+        resortMember(namesake, namesakeIndex);
+        emit q->memberRenamed(namesake);
+        notifyChanges(MembersChange);
+    }
 }
 
 void Room::Private::removeMemberFromMap(const QString& username, User* u)
 {
-    membersMap.remove(username, u);
+    membersByName.remove(username, u);
+    User* namesake = membersByName.count(username) == 1 ?
+                        membersByName.value(username) : nullptr;
+    const int namesakeIndex = namesake ? findSortedMember(namesake) : -1;
+    membersMap.remove(u->id());
+    memberNames.remove(u);
+    dropCachedNames(username);
     // If there was one namesake besides the removed user, signal member renaming
     // for it because it doesn't need to be disambiguated anymore.
     // TODO: Think about left users.
-    auto formerNamesakes = membersMap.values(username);
-    if (formerNamesakes.size() == 1)
-        emit q->memberRenamed(formerNamesakes[0]);
+    if (namesake)
+    {
+        resortMember(namesake, namesakeIndex);
+        emit q->memberRenamed(namesake);
+        notifyChanges(MembersChange);
+    }
 }
 
 inline QByteArray makeErrorStr(const Event* e, QByteArray msg)
@@ -457,8 +686,40 @@ void Room::Private::insertEvent(RoomEvent* e, Timeline::iterator where,
                            "events within the same batch arrived from the server.";
         return;
     }
+    ItemStats stats { 0, 0 };
+    if (where == timeline.end())
+    {
+        if (!timeline.empty())
+        {
+            const auto& prev = timelineStats.back();
+            stats.notableBefore =
+                prev.notableBefore + isEventNotable(timeline.back().event());
+            stats.senderRun = prev.senderRun +
+                    (timeline.back()->senderId() != e->senderId());
+        }
+        timelineStats.push_back(stats);
+    }
+    else
+    {
+        if (!timeline.empty())
+        {
+            const auto& next = timelineStats.front();
+            stats.notableBefore = next.notableBefore - isEventNotable(e);
+            stats.senderRun = next.senderRun -
+                    (timeline.front()->senderId() != e->senderId());
+        }
+        timelineStats.push_front(stats);
+    }
     timeline.emplace(where, e, index);
     eventsIndex.insert(e->id(), index);
+    if (eventStore)
+        eventStore->append(index, e);
+    // The content can only go once the event is in the store
+    if (!eventStore && connection->cacheState() && connection->cacheTimeline()
+            && Event::jsonRetention() == Event::JsonRetention::Discard)
+        e->applyJsonRetention(Event::JsonRetention::KeepBinary);
+    else
+        e->applyJsonRetention();
     Q_ASSERT(q->findInTimeline(e->id())->event() == e);
 }
 
@@ -467,26 +728,28 @@ void Room::Private::addMember(User *u)
     if (!hasMember(u))
     {
         insertMemberIntoMap(u);
+        insertSortedMember(u);
+        trackFirstTwo(firstTwoMembers, u);
         connect(u, &User::nameChanged, q,
                 [=] (User* u, const QString& newName) { renameMember(u, newName); });
         emit q->userAdded(u);
+        notifyChanges(MembersChange);
     }
 }
 
 bool Room::Private::hasMember(User* u) const
 {
-    return membersMap.values(u->name()).contains(u);
+    return membersMap.value(u->id()) == u;
 }
 
 User* Room::Private::member(const QString& id) const
 {
-    auto u = connection->user(id);
-    return hasMember(u) ? u : nullptr;
+    return membersMap.value(id, nullptr);
 }
 
 void Room::Private::renameMember(User* u, QString oldName)
 {
-    if (hasMember(u))
+    if (membersByName.contains(u->name(), u))
     {
         qCWarning(MAIN) << "Room::Private::renameMember(): the user "
                         << u->name()
@@ -494,11 +757,14 @@ void Room::Private::renameMember(User* u, QString oldName)
         return;
     }
 
-    if (membersMap.values(oldName).contains(u))
+    if (membersByName.contains(oldName, u))
     {
+        removeSortedMember(findSortedMember(u));
         removeMemberFromMap(oldName, u);
         insertMemberIntoMap(u);
+        insertSortedMember(u);
         emit q->memberRenamed(u);
+        notifyChanges(MembersChange);
     }
 }
 
@@ -508,12 +774,99 @@ void Room::Private::removeMember(User* u)
     {
         if ( !membersLeft.contains(u) )
             membersLeft.append(u);
+        removeSortedMember(findSortedMember(u));
         removeMemberFromMap(u->name(), u);
+        if (u == firstTwoMembers[0] || u == firstTwoMembers[1])
+            firstTwoMembers = findFirstTwo(membersMap);
         emit q->userRemoved(u);
+        notifyChanges(MembersChange);
     }
 }
 
+int Room::Private::sortedLowerBound(const QCollatorSortKey& key,
+                                    User* u) const
+{
+    // The same order as MemberSorter's, by the keys in sortedMemberKeys
+    return int(std::lower_bound(sortedMembers.begin(), sortedMembers.end(), u,
+        [this,&key] (User* m, User* v)
+        {
+            const auto c = sortedMemberKeys.constFind(m).value().compare(key);
+            return c < 0 || (c == 0 && m->id() < v->id());
+        }) - sortedMembers.begin());
+}
+
+int Room::Private::findSortedMember(User* u) const
+{
+    const auto keyIt = sortedMemberKeys.constFind(u);
+    if (keyIt != sortedMemberKeys.cend())
+    {
+        const auto i = sortedLowerBound(keyIt.value(), u);
+        if (i < sortedMembers.size() && sortedMembers[i] == u)
+            return i;
+    }
+    qCWarning(MAIN) << "Room::Private::findSortedMember(): member" << u->id()
+                    << "is not in the sorted member list of room" << id;
+    return -1;
+}
+
+void Room::Private::insertSortedMember(User* u)
+{
+    const auto key = memberName(u).sortKey;
+    const int i = sortedLowerBound(key, u);
+    emit q->aboutToInsertMember(u, i);
+    sortedMembers.insert(i, u);
+    sortedMemberKeys.insert(u, key);
+    emit q->insertedMember(u, i);
+}
+
+void Room::Private::removeSortedMember(int index)
+{
+    if (index < 0)
+        return;
+
+    User* u = sortedMembers[index];
+    emit q->aboutToRemoveMember(u, index);
+    sortedMembers.removeAt(index);
+    sortedMemberKeys.remove(u);
+    emit q->removedMember(u, index);
+}
+
+void Room::Private::resortMember(User* u, int oldIndex)
+{
+    removeSortedMember(oldIndex);
+    insertSortedMember(u);
+}
+
+void Room::Private::dropCachedNames(const QString& username)
+{
+    for (auto it = membersByName.constFind(username);
+         it != membersByName.cend() && it.key() == username; ++it)
+        memberNames.remove(it.value());
+}
+
+Room::Private::MemberName Room::Private::memberName(User* u) const
+{
+    auto it = memberNames.constFind(u);
+    if (it != memberNames.cend())
+        return it.value();
+
+    auto name = disambiguatedName(u);
+    // Most names need no disambiguation; reuse the key the user already has
+    const auto sortKey = name == u->displayname() ?
+                            u->sortKey() : User::makeSortKey(name);
+    MemberName result { std::move(name), sortKey };
+    // Non-members are not cached: there's no way to track their renames
+    if (hasMember(u))
+        memberNames.insert(u, result);
+    return result;
+}
+
 QString Room::roomMembername(User *u) const
+{
+    return d->memberName(u).name;
+}
+
+QString Room::Private::disambiguatedName(User *u) const
 {
     // See the CS spec, section 11.2.2.3
 
@@ -521,10 +874,9 @@ QString Room::roomMembername(User *u) const
     if (username.isEmpty())
         return u->id();
 
-    // Get the list of users with the same display name. Most likely,
-    // there'll be one, but there's a chance there are more.
-    auto namesakes = d->membersMap.values(username);
-    if (namesakes.size() == 1)
+    // Count users with the same display name. Most likely, there'll be one,
+    // but there's a chance there are more.
+    if (membersByName.count(username) == 1)
         return username;
 
     // We expect a user to be a member of the room - but technically it is
@@ -537,7 +889,7 @@ QString Room::roomMembername(User *u) const
 //    {
 //        qCWarning()
 //            << "Room::roomMemberName(): user" << u->id()
-//            << "is not a member of the room" << id();
+//            << "is not a member of the room" << id;
 //    }
 
     // In case of more than one namesake, disambiguate with user id.
@@ -551,7 +903,14 @@ QString Room::roomMembername(const QString& userId) const
 
 void Room::updateData(SyncRoomData&& data)
 {
-    if( d->prevBatch.isEmpty() )
+    d->stateDirty = true;
+    d->updatingData = true;
+    // A limited timeline coming to a room with nothing loaded yet (e.g.,
+    // the first sync after a restart) leaves a gap after the stored events;
+    // with events already in the timeline the gap is not tracked so far.
+    if (data.timelineLimited && d->timeline.empty())
+        d->dropStoredTimeline(data.timelinePrevBatch);
+    else if( d->prevBatch.isEmpty() )
         d->prevBatch = data.timelinePrevBatch;
     setJoinState(data.joinState);
 
@@ -579,8 +938,16 @@ void Room::updateData(SyncRoomData&& data)
     if (!data.ephemeral.empty())
     {
         et.restart();
+        // Receipts are collected from the whole batch and applied at once
+        d->collectingReceipts = true;
         for( auto ephemeralEvent: data.ephemeral )
             processEphemeralEvent(ephemeralEvent);
+        d->collectingReceipts = false;
+        if (!d->pendingReceipts.empty())
+        {
+            d->processReceipts(d->pendingReceipts);
+            d->pendingReceipts.clear();
+        }
         qCDebug(PROFILER) << "*** Room::processEphemeralEvents():"
                           << et.elapsed() << "ms";
     }
@@ -588,13 +955,50 @@ void Room::updateData(SyncRoomData&& data)
     if( data.highlightCount != d->highlightCount )
     {
         d->highlightCount = data.highlightCount;
-        emit highlightCountChanged(this);
+        d->notifyChanges(HighlightCountChange);
     }
     if( data.notificationCount != d->notificationCount )
     {
         d->notificationCount = data.notificationCount;
-        emit notificationCountChanged(this);
+        d->notifyChanges(NotificationCountChange);
     }
+    d->updatingData = false;
+    d->emitPendingChanges();
+}
+
+void Room::Private::notifyChanges(Changes changes)
+{
+    if (changes & (NameChange|MembersChange))
+        displaynameDirty = true;
+    pendingChanges |= changes;
+    if (!updatingData)
+        emitPendingChanges();
+}
+
+void Room::Private::emitPendingChanges()
+{
+    const auto changes = pendingChanges;
+    if (!changes)
+        return;
+    pendingChanges = NoChange;
+
+    if (changes & NameChange)
+        emit q->namesChanged(q);
+    if (changes & DisplaynameChange)
+        emit q->displaynameChanged(q);
+    if (changes & TopicChange)
+        emit q->topicChanged();
+    if (changes & AvatarChange)
+        emit q->avatarChanged();
+    if (changes & ReadMarkerChange)
+        emit q->readMarkerMoved();
+    if (changes & UnreadMessagesChange)
+        emit q->unreadMessagesChanged(q);
+    if (changes & HighlightCountChange)
+        emit q->highlightCountChanged(q);
+    if (changes & NotificationCountChange)
+        emit q->notificationCountChanged(q);
+    emit q->changed(changes);
 }
 
 void Room::postMessage(const QString& type, const QString& plainText)
@@ -625,6 +1029,28 @@ void Room::getPreviousContent(int limit)
 
 void Room::Private::getPreviousContent(int limit)
 {
+    // Try the local store first; the events in it are contiguous with
+    // the timeline, so it's enough to continue from the oldest loaded one.
+    if (auto* store = openEventStore())
+    {
+        if (!timeline.empty())
+        {
+            auto events = store->loadBackwards(q->minTimelineIndex(), limit);
+            if (!events.empty())
+            {
+                qCDebug(MAIN) << "Loaded" << events.size()
+                              << "historical event(s) from the local store";
+                q->addHistoricalMessageEvents(std::move(events));
+                return;
+            }
+        }
+    }
+    if (historyEvicted)
+    {
+        qCDebug(MAIN) << "Room" << id << "has evicted its history, "
+                         "not requesting older events from the server";
+        return;
+    }
     if( !roomMessagesJob )
     {
         roomMessagesJob =
@@ -634,12 +1060,101 @@ void Room::Private::getPreviousContent(int limit)
             {
                 q->addHistoricalMessageEvents(roomMessagesJob->releaseEvents());
                 prevBatch = roomMessagesJob->end();
+                stateDirty = true;
             }
             roomMessagesJob = nullptr;
         });
     }
 }
 
+EventStore* Room::Private::openEventStore()
+{
+    // The store only makes sense along with the state cache that keeps
+    // prevBatch to continue from once the stored events are exhausted
+    if (!connection->cacheState() || !connection->cacheTimeline())
+    {
+        eventStore.reset();
+        return nullptr;
+    }
+    if (eventStore)
+        return eventStore.get();
+
+    const QDir storeDir { connection->timelineCachePath() };
+    if (!storeDir.exists())
+        storeDir.mkpath(".");
+    std::unique_ptr<EventStore> store {
+        new EventStore(EventStore::fileName(storeDir.path(), id))
+    };
+    if (!store->open())
+    {
+        qCWarning(MAIN) << "Couldn't open the event store for room" << id
+                        << ":" << store->errorString();
+        return nullptr;
+    }
+
+    if (!timeline.empty())
+    {
+        // Indices in the timeline have nothing to do with the stored ones
+        if (!store->isEmpty())
+        {
+            qCDebug(MAIN) << "Room" << id
+                          << "already has a timeline, resetting the event store";
+            store->clear();
+        }
+        // Events that came while timeline caching was off may only have
+        // their content rebuilt from typed data (see Event::JsonRetention);
+        // the rest still have full JSON and can have the retention applied
+        // once stored.
+        eventStore = std::move(store);
+        for (const auto& ti: timeline)
+        {
+            eventStore->append(ti.index(), ti.event());
+            ti.event()->applyJsonRetention();
+        }
+        eventStore->flush();
+        return eventStore.get();
+    }
+
+    eventStore = std::move(store);
+    if (!eventStore->isEmpty())
+    {
+        // Only load a window of the most recent events; the rest is loaded
+        // by getPreviousContent() on demand.
+        static const int EventStoreWindow = 20;
+        baseIndex = eventStore->maxIndex();
+        auto events =
+            eventStore->loadBackwards(baseIndex + 1, EventStoreWindow);
+        qCDebug(MAIN) << "Loaded" << events.size()
+                      << "event(s) from the local store for room" << id;
+        if (!events.empty())
+            q->addHistoricalMessageEvents(std::move(events));
+    }
+    return eventStore.get();
+}
+
+void Room::Private::dropStoredTimeline(const QString& newPrevBatch)
+{
+    prevBatch = newPrevBatch;
+    historyEvicted = false;
+    if (eventStore)
+        eventStore->clear();
+    else if (connection->cacheState() && connection->cacheTimeline())
+    {
+        // Don't let openEventStore() load the stale events
+        const auto fileName =
+            EventStore::fileName(connection->timelineCachePath(), id);
+        if (QFile::exists(fileName) && !QFile::remove(fileName))
+        {
+            qCWarning(MAIN) << "Couldn't remove the event store" << fileName;
+            return;
+        }
+    }
+    else
+        return;
+    qCDebug(MAIN) << "Room" << id << "got a limited timeline,"
+                     " the local event store is dropped";
+}
+
 void Room::inviteToRoom(const QString& memberId)
 {
     connection()->callApi<InviteUserJob>(id(), memberId);
@@ -689,12 +1204,22 @@ User* Room::localUser() const
 
 void Room::addNewMessageEvents(RoomEvents events)
 {
+    // Make sure to load stored events before any new ones are added
+    auto* store = d->openEventStore();
     d->dropDuplicateEvents(&events);
     if (events.empty())
         return;
     emit aboutToAddNewMessages(events);
     doAddNewMessageEvents(events);
     emit addedMessages();
+    d->notifyChanges(TimelineChange);
+    if (store)
+        store->flush();
+
+    const auto budget = d->timelineBudget > 0 ? d->timelineBudget
+                                              : connection()->timelineBudget();
+    if (budget > 0)
+        evictOldestEvents(budget);
 }
 
 void Room::doAddNewMessageEvents(const RoomEvents& events)
@@ -727,7 +1252,8 @@ void Room::doAddNewMessageEvents(const RoomEvents& events)
     if( !d->unreadMessages && newUnreadMessages > 0)
     {
         d->unreadMessages = true;
-        emit unreadMessagesChanged(this);
+        d->stateDirty = true;
+        d->notifyChanges(UnreadMessagesChange);
         qCDebug(MAIN) << "Room" << displayName() << "has unread messages";
     }
 }
@@ -740,6 +1266,9 @@ void Room::addHistoricalMessageEvents(RoomEvents events)
     emit aboutToAddHistoricalMessages(events);
     doAddHistoricalMessageEvents(events);
     emit addedMessages();
+    d->notifyChanges(TimelineChange);
+    if (d->eventStore)
+        d->eventStore->flush();
 }
 
 void Room::doAddHistoricalMessageEvents(const RoomEvents& events)
@@ -767,6 +1296,8 @@ void Room::doAddHistoricalMessageEvents(const RoomEvents& events)
 
 void Room::processStateEvents(const RoomEvents& events)
 {
+    if (!events.empty())
+        d->stateDirty = true;
     bool emitNamesChanged = false;
     for (auto event: events)
     {
@@ -797,7 +1328,7 @@ void Room::processStateEvents(const RoomEvents& events)
                 auto topicEvent = static_cast<RoomTopicEvent*>(event);
                 d->topic = topicEvent->topic();
                 qCDebug(MAIN) << "Room topic updated:" << d->topic;
-                emit topicChanged();
+                d->notifyChanges(TopicChange);
                 break;
             }
             case EventType::RoomAvatar: {
@@ -807,7 +1338,7 @@ void Room::processStateEvents(const RoomEvents& events)
                 {
                     qCDebug(MAIN) << "Room avatar URL updated:"
                                   << avatarEventContent.url.toString();
-                    emit avatarChanged();
+                    d->notifyChanges(AvatarChange);
                 }
                 break;
             }
@@ -830,7 +1361,7 @@ void Room::processStateEvents(const RoomEvents& events)
         }
     }
     if (emitNamesChanged) {
-        emit namesChanged(this);
+        d->notifyChanges(NameChange);
     }
     d->updateDisplayname();
 }
@@ -852,39 +1383,10 @@ void Room::processEphemeralEvent(Event* event)
         }
         case EventType::Receipt: {
             auto receiptEvent = static_cast<ReceiptEvent*>(event);
-            for( const auto &p: receiptEvent->eventsWithReceipts() )
-            {
-                {
-                    if (p.receipts.size() == 1)
-                        qCDebug(EPHEMERAL) << "Marking" << p.evtId
-                                           << "as read for" << p.receipts[0].userId;
-                    else
-                        qCDebug(EPHEMERAL) << "Marking" << p.evtId
-                                           << "as read for"
-                                           << p.receipts.size() << "users";
-                }
-                if (d->eventsIndex.contains(p.evtId))
-                {
-                    const auto newMarker = findInTimeline(p.evtId);
-                    for( const Receipt& r: p.receipts )
-                        if (auto m = d->member(r.userId))
-                            d->promoteReadMarker(m, newMarker);
-                } else
-                {
-                    qCDebug(EPHEMERAL) << "Event" << p.evtId
-                                       << "not found; saving read receipts anyway";
-                    // If the event is not found (most likely, because it's too old
-                    // and hasn't been fetched from the server yet), but there is
-                    // a previous marker for a user, keep the previous marker.
-                    // Otherwise, blindly store the event id for this user.
-                    for( const Receipt& r: p.receipts )
-                        if (auto m = d->member(r.userId))
-                            if (readMarker(m) == timelineEdge())
-                                d->setLastReadEvent(m, p.evtId);
-                }
-            }
-            if (receiptEvent->unreadMessages())
-                d->unreadMessages = true;
+            if (d->collectingReceipts)
+                d->pendingReceipts.push_back(receiptEvent);
+            else
+                d->processReceipts({ receiptEvent });
             break;
         }
         default:
@@ -893,7 +1395,99 @@ void Room::processEphemeralEvent(Event* event)
     }
 }
 
-QString Room::Private::roomNameFromMemberNames(const QList<User *> &userlist) const
+void Room::Private::processReceipts(
+        const std::vector<ReceiptEvent*>& receiptEvents)
+{
+    // Collapse all receipts to the newest marker per user; users whose
+    // receipts only point to events not in the timeline are kept separately.
+    QHash<User*, rev_iter_t> newMarkers;
+    QHash<User*, QString> unknownEventIds;
+    int receiptsCount = 0;
+    for (auto receiptEvent: receiptEvents)
+    {
+        for (const auto& p: receiptEvent->eventsWithReceipts())
+        {
+            receiptsCount += int(p.receipts.size());
+            const auto marker = q->findInTimeline(p.evtId);
+            for (const Receipt& r: p.receipts)
+            {
+                auto m = member(r.userId);
+                if (!m)
+                    continue;
+                if (marker == q->timelineEdge())
+                {
+                    unknownEventIds.insert(m, p.evtId);
+                    continue;
+                }
+                auto it = newMarkers.find(m);
+                if (it == newMarkers.end())
+                    newMarkers.insert(m, marker);
+                else if (marker < it.value()) // Reverse iterators: newer is less
+                    it.value() = marker;
+            }
+        }
+        if (receiptEvent->unreadMessages())
+        {
+            unreadMessages = true;
+            stateDirty = true;
+        }
+    }
+    qCDebug(EPHEMERAL) << "Processing" << receiptsCount << "receipt(s) for"
+                       << newMarkers.size() + unknownEventIds.size()
+                       << "user(s) in room" << id;
+
+    batchingReceipts = true;
+    for (auto it = newMarkers.cbegin(); it != newMarkers.cend(); ++it)
+        promoteReadMarker(it.key(), it.value());
+    // If the event is not found (most likely, because it's too old and hasn't
+    // been fetched from the server yet), but there is a previous marker for
+    // a user, keep the previous marker. Otherwise, blindly store the event id
+    // for this user.
+    for (auto it = unknownEventIds.cbegin(); it != unknownEventIds.cend(); ++it)
+        if (!newMarkers.contains(it.key()) &&
+                q->readMarker(it.key()) == q->timelineEdge())
+            setLastReadEvent(it.key(), it.value());
+    batchingReceipts = false;
+
+    if (readersChanged.isEmpty())
+        return;
+    const auto changed = std::move(readersChanged);
+    readersChanged.clear();
+    emit q->lastReadEventsChanged(changed);
+    auto* localUser = connection->user();
+    if (changed.contains(localUser))
+    {
+        emit q->lastReadEventChanged(localUser);
+        notifyChanges(ReadMarkerChange);
+    }
+}
+
+void Room::Private::trackFirstTwo(std::array<User*, 2>& firstTwo,
+                                  User* u) const
+{
+    // Filter out the "me" user so that it never hits the room name
+    if (isLocalUser(u))
+        return;
+    if (!firstTwo[0] || u->id() < firstTwo[0]->id())
+    {
+        firstTwo[1] = firstTwo[0];
+        firstTwo[0] = u;
+    }
+    else if (!firstTwo[1] || u->id() < firstTwo[1]->id())
+        firstTwo[1] = u;
+}
+
+template <typename ContT>
+std::array<User*, 2> Room::Private::findFirstTwo(const ContT& users) const
+{
+    std::array<User*, 2> firstTwo = { {nullptr, nullptr} };
+    for (auto u: users)
+        trackFirstTwo(firstTwo, u);
+    return firstTwo;
+}
+
+QString Room::Private::roomNameFromMemberNames(
+        const std::array<User*, 2>& firstTwo, int usersCount) const
 {
     // This is part 3(i,ii,iii) in the room displayname algorithm described
     // in the CS spec (see also Room::Private::updateDisplayname() ).
@@ -901,34 +1495,23 @@ QString Room::Private::roomNameFromMemberNames(const QList<User *> &userlist) co
     // and use disambiguated display names of two topmost users excluding
     // the current one to render the name of the room.
 
-    // std::array is the leanest C++ container
-    std::array<User*, 2> first_two = { {nullptr, nullptr} };
-    std::partial_sort_copy(
-        userlist.begin(), userlist.end(),
-        first_two.begin(), first_two.end(),
-        [this](const User* u1, const User* u2) {
-            // Filter out the "me" user so that it never hits the room name
-            return isLocalUser(u2) || (!isLocalUser(u1) && u1->id() < u2->id());
-        }
-    );
-
-    // i. One-on-one chat. first_two[1] == localUser() in this case.
-    if (userlist.size() == 2)
-        return q->roomMembername(first_two[0]);
+    // i. One-on-one chat. The other user is the only one in firstTwo.
+    if (usersCount == 2)
+        return q->roomMembername(firstTwo[0]);
 
     // ii. Two users besides the current one.
-    if (userlist.size() == 3)
+    if (usersCount == 3)
         return tr("%1 and %2")
-                .arg(q->roomMembername(first_two[0]))
-                .arg(q->roomMembername(first_two[1]));
+                .arg(q->roomMembername(firstTwo[0]))
+                .arg(q->roomMembername(firstTwo[1]));
 
     // iii. More users.
-    if (userlist.size() > 3)
+    if (usersCount > 3)
         return tr("%1 and %L2 others")
-                .arg(q->roomMembername(first_two[0]))
-                .arg(userlist.size() - 3);
+                .arg(q->roomMembername(firstTwo[0]))
+                .arg(usersCount - 3);
 
-    // userlist.size() < 2 - apparently, there's only current user in the room
+    // usersCount < 2 - apparently, there's only current user in the room
     return QString();
 }
 
@@ -947,12 +1530,14 @@ QString Room::Private::calculateDisplayname() const
         return canonicalAlias;
 
     // 3. Room members
-    QString topMemberNames = roomNameFromMemberNames(membersMap.values());
+    QString topMemberNames =
+        roomNameFromMemberNames(firstTwoMembers, membersMap.size());
     if (!topMemberNames.isEmpty())
         return topMemberNames;
 
     // 4. Users that previously left the room
-    topMemberNames = roomNameFromMemberNames(membersLeft);
+    topMemberNames = roomNameFromMemberNames(findFirstTwo(membersLeft),
+                                             membersLeft.size());
     if (!topMemberNames.isEmpty())
         return tr("Empty room (was: %1)").arg(topMemberNames);
 
@@ -966,10 +1551,14 @@ QString Room::Private::calculateDisplayname() const
 
 void Room::Private::updateDisplayname()
 {
+    if (!displaynameDirty)
+        return;
+    displaynameDirty = false;
+
     const QString old_name = displayname;
     displayname = calculateDisplayname();
     if (old_name != displayname)
-        emit q->displaynameChanged(q);
+        notifyChanges(DisplaynameChange);
 }
 
 template <typename T>
@@ -1052,6 +1641,16 @@ QJsonObject Room::Private::toJson() const
         result.insert("ephemeral", ephemeralObj);
     }
 
+    // With the timeline stored locally, the pagination token should
+    // persist to continue loading history once the stored events run out
+    if (connection->cacheState() && connection->cacheTimeline() &&
+            !prevBatch.isEmpty())
+    {
+        QJsonObject timelineObj;
+        timelineObj.insert("prev_batch", prevBatch);
+        result.insert("timeline", timelineObj);
+    }
+
     QJsonObject unreadNotificationsObj;
     unreadNotificationsObj.insert("highlight_count", highlightCount);
     unreadNotificationsObj.insert("notification_count", notificationCount);
@@ -1065,6 +1664,16 @@ QJsonObject Room::toJson() const
     return d->toJson();
 }
 
+bool Room::isStateDirty() const
+{
+    return d->stateDirty;
+}
+
+void Room::markStateSaved()
+{
+    d->stateDirty = false;
+}
+
 MemberSorter Room::memberSorter() const
 {
     return MemberSorter(this);
@@ -1072,11 +1681,8 @@ MemberSorter Room::memberSorter() const
 
 bool MemberSorter::operator()(User *u1, User *u2) const
 {
-    auto n1 = room->roomMembername(u1);
-    auto n2 = room->roomMembername(u2);
-    if (n1[0] == '@')
-        n1.remove(0, 1);
-    if (n2[0] == '@')
-        n2.remove(0, 1);
-    return n1.localeAwareCompare(n2) < 0;
+    const auto c = room->d->memberName(u1).sortKey
+                    .compare(room->d->memberName(u2).sortKey);
+    // Names that collate equally are ordered by ids to keep the order strict
+    return c < 0 || (c == 0 && u1->id() < u2->id());
 }
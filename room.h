@@ -79,6 +79,26 @@ namespace QMatrixClient
             using Timeline = std::deque<TimelineItem>;
             using rev_iter_t = Timeline::const_reverse_iterator;
 
+            /** Kinds of room changes reported by the changed() signal */
+            enum Change : uint
+            {
+                NoChange = 0x0,
+                NameChange = 0x1, //< Name, aliases or canonical alias
+                DisplaynameChange = 0x2,
+                TopicChange = 0x4,
+                AvatarChange = 0x8,
+                JoinStateChange = 0x10,
+                MembersChange = 0x20,
+                TimelineChange = 0x40,
+                ReadMarkerChange = 0x80,
+                UnreadMessagesChange = 0x100,
+                HighlightCountChange = 0x200,
+                NotificationCountChange = 0x400,
+                AnyChange = 0x7FF
+            };
+            Q_DECLARE_FLAGS(Changes, Change)
+            Q_FLAGS(Changes)
+
             Room(Connection* connection, QString id, JoinState initialJoinState);
             ~Room() override;
 
@@ -96,8 +116,41 @@ namespace QMatrixClient
 
             Q_INVOKABLE QList<User*> users() const;
             Q_INVOKABLE QStringList memberNames() const;
+            /**
+             * Current members of the room, sorted with MemberSorter
+             *
+             * The list is kept in order as members join, leave or get
+             * renamed; each insertion and removal is reported by
+             * aboutToInsertMember()/insertedMember() and
+             * aboutToRemoveMember()/removedMember() respectively.
+             */
+            const QList<User*>& sortedMembers() const;
             Q_INVOKABLE int memberCount() const;
+            /** The number of events currently resident in the timeline */
             Q_INVOKABLE int timelineSize() const;
+            /** The number of events evicted from the timeline so far */
+            Q_INVOKABLE int evictedEventsCount() const;
+
+            /**
+             * The maximal number of events kept in the timeline when new
+             * events arrive; 0 means using Connection::timelineBudget()
+             */
+            int timelineBudget() const;
+            void setTimelineBudget(int maxEvents);
+            /**
+             * @brief Evicts the oldest events so that at most keepEvents
+             * remain in the timeline
+             *
+             * If the timeline is stored locally (see Connection::cacheTimeline),
+             * evicted events are reloaded by getPreviousContent() on demand.
+             * Otherwise they are lost for the Room object, and
+             * getPreviousContent() no more goes to the server since
+             * the pagination token doesn't match the oldest resident event.
+             * A pending request for older events is abandoned.
+             * At least one event always stays in the timeline.
+             * @return the number of evicted events
+             */
+            int evictOldestEvents(int keepEvents);
 
             /**
              * Returns a room avatar and requests it from the network if needed
@@ -152,6 +205,15 @@ namespace QMatrixClient
             MemberSorter memberSorter() const;
 
             QJsonObject toJson() const;
+            /**
+             * Whether the room state that goes to toJson() has changed since
+             * the last markStateSaved() call (or since the room creation)
+             *
+             * This is used by Connection::saveState() to only write
+             * changed rooms to the state cache.
+             */
+            bool isStateDirty() const;
+            void markStateSaved();
             void updateData(SyncRoomData&& data );
             void setJoinState( JoinState state );
 
@@ -175,9 +237,25 @@ namespace QMatrixClient
             void markAllMessagesAsRead();
 
         signals:
+            /**
+             * @brief The room has changed; emitted once per updateData()
+             *
+             * While the room is being updated from a sync, emissions of
+             * namesChanged(), displaynameChanged(), topicChanged(),
+             * avatarChanged(), readMarkerMoved(), unreadMessagesChanged(),
+             * highlightCountChanged() and notificationCountChanged() are
+             * deferred to the end of the update, happen at most once each
+             * and are followed by changed() carrying all the changes
+             * in the update. Outside of updates, changed() follows every
+             * change immediately. Other signals are not deferred.
+             */
+            void changed(Changes changes);
             void aboutToAddHistoricalMessages(const RoomEvents& events);
             void aboutToAddNewMessages(const RoomEvents& events);
             void addedMessages();
+            /** The count oldest events are about to be evicted */
+            void aboutToEvictMessages(int count);
+            void evictedMessages();
 
             /**
              * @brief The room name, the canonical alias or other aliases changed
@@ -192,11 +270,36 @@ namespace QMatrixClient
             void userAdded(User* user);
             void userRemoved(User* user);
             void memberRenamed(User* user);
+            /**
+             * @brief A member is about to be inserted into sortedMembers()
+             *
+             * A member changing its position in the list because of
+             * renaming is first removed and then inserted again.
+             */
+            void aboutToInsertMember(User* user, int index);
+            void insertedMember(User* user, int index);
+            void aboutToRemoveMember(User* user, int index);
+            void removedMember(User* user, int index);
             void joinStateChanged(JoinState oldState, JoinState newState);
             void typingChanged();
             void highlightCountChanged(Room* room);
             void notificationCountChanged(Room* room);
+            /**
+             * The last read event of a user changed, either locally (see
+             * markMessagesAsRead()) or by promoting the read marker over
+             * newly arrived events of the same user. Of the read receipts
+             * from the server, only those of the local user are reported
+             * by this signal; receipts of all users come in
+             * lastReadEventsChanged(), once per batch. Clients that used
+             * this signal to follow read markers of other users should
+             * connect to lastReadEventsChanged() instead.
+             */
             void lastReadEventChanged(User* user);
+            /**
+             * Read receipts from the server moved last read events
+             * of the users; emitted once per batch of ephemeral events
+             */
+            void lastReadEventsChanged(const QList<User*>& users);
             void readMarkerMoved();
             void unreadMessagesChanged(Room* room);
 
@@ -204,9 +307,16 @@ namespace QMatrixClient
             virtual void doAddNewMessageEvents(const RoomEvents& events);
             virtual void doAddHistoricalMessageEvents(const RoomEvents& events);
             virtual void processStateEvents(const RoomEvents& events);
+            /**
+             * Processes an ephemeral event. Receipt events passed here by
+             * updateData() are only collected; they are applied together
+             * after the whole ephemeral batch is processed. Overrides should
+             * call this implementation for receipts they don't consume.
+             */
             virtual void processEphemeralEvent(Event* event);
 
         private:
+            friend class MemberSorter;
             class Private;
             Private* d;
 
@@ -234,3 +344,4 @@ namespace QMatrixClient
             const Room* room;
     };
 }  // namespace QMatrixClient
+Q_DECLARE_OPERATORS_FOR_FLAGS(QMatrixClient::Room::Changes)
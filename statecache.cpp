@@ -0,0 +1,301 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "statecache.h"
+
+#include "logging.h"
+
+#include <QtCore/QJsonDocument>
+#include <QtCore/QtEndian>
+
+#include <cstring>
+
+using namespace QMatrixClient;
+
+static const char Signature[4] = { 'Q', 'M', 'S', 'C' };
+static const qint64 HeaderSize = sizeof(Signature) + sizeof(quint32);
+// The size of a record prefix and the required alignment of binary JSON
+static const qint64 RecordAlignment = sizeof(quint32);
+
+const quint32 StateCache::FormatVersion = 1;
+
+StateCache::StateCache(const QString& fileName)
+    : file(fileName), newFile(fileName)
+{ }
+
+StateCache::~StateCache()
+{
+    close();
+}
+
+bool StateCache::isStateCache(const QString& fileName)
+{
+    QFile f { fileName };
+    if (!f.open(QFile::ReadOnly))
+        return false;
+    return f.read(sizeof(Signature)) == QByteArray(Signature, sizeof(Signature));
+}
+
+bool StateCache::openForReading()
+{
+    close();
+    if (!file.open(QFile::ReadOnly))
+        return false;
+
+    dataSize = file.size();
+    if (dataSize < HeaderSize)
+    {
+        qCWarning(MAIN) << "State cache" << file.fileName() << "is truncated";
+        return false;
+    }
+    data = file.map(0, dataSize);
+    if (!data)
+    {
+        qCWarning(MAIN) << "Could not map" << file.fileName()
+                        << "into memory:" << file.errorString();
+        return false;
+    }
+    if (!checkHeader(data))
+    {
+        close();
+        return false;
+    }
+
+    // Index the records; if the same room occurs more than once,
+    // the latest record wins.
+    for (auto offset = HeaderSize; offset < dataSize;)
+    {
+        if (dataSize - offset < RecordAlignment)
+            break;
+        const auto recordSize = qint64(qFromLittleEndian<quint32>(data + offset));
+        const auto paddedSize =
+            (recordSize + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+        if (offset + RecordAlignment + paddedSize > dataSize)
+        {
+            qCWarning(MAIN) << "State cache" << file.fileName()
+                            << "is truncated at offset" << offset
+                            << "- ignoring the rest of it";
+            break;
+        }
+
+        const auto record = recordAt(offset);
+        if (record.contains("next_batch"))
+            lastNextBatch = record.value("next_batch").toString();
+        else
+        {
+            const auto roomId = record.value("room_id").toString();
+            const room_key_t key { roomId,
+                record.value("join_state").toString() ==
+                    toCString(JoinState::Invite) };
+            if (record.contains("removed"))
+                roomRecords.remove(key);
+            else if (!roomId.isEmpty())
+                roomRecords.insert(key, offset);
+        }
+        ++records;
+        offset += RecordAlignment + paddedSize;
+    }
+    return true;
+}
+
+bool StateCache::openForWriting()
+{
+    close();
+    out = &newFile;
+    if (!newFile.open(QFile::WriteOnly))
+        return false;
+
+    char header[HeaderSize];
+    memcpy(header, Signature, sizeof(Signature));
+    qToLittleEndian<quint32>(FormatVersion,
+                             reinterpret_cast<uchar*>(header + sizeof(Signature)));
+    return out->write(header, HeaderSize) == HeaderSize;
+}
+
+bool StateCache::openForAppending()
+{
+    close();
+    if (!file.open(QFile::ReadWrite))
+        return false;
+
+    const auto size = file.size();
+    const auto* header = size < HeaderSize ? nullptr : file.map(0, size);
+    if (!header || !checkHeader(header))
+    {
+        close();
+        return false;
+    }
+    // Find the end of the last complete record, only hopping over sizes;
+    // if a previous write has been interrupted, the broken tail is dropped
+    // so that new records are not hidden behind it.
+    auto end = HeaderSize;
+    while (size - end >= RecordAlignment)
+    {
+        const auto recordSize = qint64(qFromLittleEndian<quint32>(header + end));
+        const auto next = end + RecordAlignment +
+            (recordSize + RecordAlignment - 1) / RecordAlignment * RecordAlignment;
+        if (next > size)
+            break;
+        end = next;
+    }
+    file.unmap(const_cast<uchar*>(header));
+    if (end != size)
+    {
+        qCWarning(MAIN) << "State cache" << file.fileName()
+                        << "has a broken tail, dropping" << size - end << "bytes";
+        if (!file.resize(end))
+            return false;
+    }
+    if (!file.seek(end))
+        return false;
+    out = &file;
+    return true;
+}
+
+bool StateCache::commit()
+{
+    if (!out)
+        return false;
+    return out == &newFile ? newFile.commit() : out->flush();
+}
+
+bool StateCache::checkHeader(const uchar* header)
+{
+    if (memcmp(header, Signature, sizeof(Signature)) != 0)
+    {
+        qCWarning(MAIN) << file.fileName() << "is not a binary state cache";
+        return false;
+    }
+    const auto version =
+        qFromLittleEndian<quint32>(header + sizeof(Signature));
+    if (version != FormatVersion)
+    {
+        qCWarning(MAIN) << "State cache" << file.fileName() << "has version"
+                        << version << "while only version" << FormatVersion
+                        << "is supported; ignoring the cache";
+        return false;
+    }
+    return true;
+}
+
+void StateCache::close()
+{
+    if (newFile.isOpen())
+    {
+        newFile.cancelWriting();
+        newFile.commit();
+    }
+    out = nullptr;
+    if (data)
+    {
+        file.unmap(const_cast<uchar*>(data));
+        data = nullptr;
+    }
+    dataSize = 0;
+    records = 0;
+    roomRecords.clear();
+    if (file.isOpen())
+        file.close();
+}
+
+QString StateCache::nextBatch() const
+{
+    return lastNextBatch;
+}
+
+void StateCache::forEachRoom(const room_visitor_t& visitor) const
+{
+    for (auto offset: roomRecords)
+    {
+        const auto record = recordAt(offset);
+        const auto joinStateName = record.value("join_state").toString();
+        JoinState joinState = JoinState::Join;
+        for (size_t i = 0; i < JoinStateStrings.size(); ++i)
+            if (joinStateName == JoinStateStrings[i])
+                joinState = JoinState(i);
+        visitor(record.value("room_id").toString(), joinState,
+                record.value("state").toObject());
+    }
+}
+
+int StateCache::recordCount() const
+{
+    return records;
+}
+
+int StateCache::roomCount() const
+{
+    return roomRecords.size();
+}
+
+bool StateCache::writeNextBatch(const QString& nextBatch)
+{
+    QJsonObject record;
+    record.insert("next_batch", nextBatch);
+    return writeRecord(record);
+}
+
+bool StateCache::writeRoom(const QString& roomId, JoinState joinState,
+                           const QJsonObject& roomState)
+{
+    QJsonObject record;
+    record.insert("room_id", roomId);
+    record.insert("join_state", QString(toCString(joinState)));
+    record.insert("state", roomState);
+    return writeRecord(record);
+}
+
+bool StateCache::writeRoomRemoval(const QString& roomId, JoinState joinState)
+{
+    QJsonObject record;
+    record.insert("room_id", roomId);
+    record.insert("join_state", QString(toCString(joinState)));
+    record.insert("removed", true);
+    return writeRecord(record);
+}
+
+QString StateCache::errorString() const
+{
+    return out ? out->errorString() : file.errorString();
+}
+
+QJsonObject StateCache::recordAt(qint64 offset) const
+{
+    const auto recordSize = qFromLittleEndian<quint32>(data + offset);
+    // The mapping is page-aligned and all records are padded, so
+    // the binary JSON data satisfy the alignment requirement of fromRawData().
+    return QJsonDocument::fromRawData(
+                reinterpret_cast<const char*>(data + offset + RecordAlignment),
+                int(recordSize), QJsonDocument::Validate).object();
+}
+
+bool StateCache::writeRecord(const QJsonObject& record)
+{
+    auto payload = QJsonDocument(record).toBinaryData();
+    const auto recordSize = quint32(payload.size());
+    payload.append(QByteArray(
+        int((RecordAlignment - recordSize % RecordAlignment) % RecordAlignment),
+        '\0'));
+
+    uchar sizeBytes[RecordAlignment];
+    qToLittleEndian(recordSize, sizeBytes);
+    return out &&
+           out->write(reinterpret_cast<const char*>(sizeBytes),
+                      RecordAlignment) == RecordAlignment &&
+           out->write(payload) == payload.size();
+}
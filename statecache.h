@@ -0,0 +1,131 @@
+/******************************************************************************
+ * Copyright (C) 2017 libqmatrixclient contributors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#pragma once
+
+#include "joinstate.h"
+
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QJsonObject>
+#include <QtCore/QSaveFile>
+
+#include <functional>
+
+namespace QMatrixClient
+{
+    /**
+     * A binary, memory-mappable cache of the rooms state
+     *
+     * The cache file consists of a header (a signature followed by the format
+     * version) and a sequence of records. Every record is a JSON object in
+     * Qt's binary JSON format (see QJsonDocument::toBinaryData()), prepended
+     * by its size and padded to a 4-byte boundary. A record holds either
+     * "next_batch" or a room, in the latter case having "room_id",
+     * "join_state" and "state" (the room object, in the same format as
+     * in a /sync response).
+     *
+     * Records are only ever appended: a room record replaces any earlier
+     * record for the same room, and a removal record (having "room_id",
+     * "join_state" and "removed") drops it. This allows to save only changed
+     * rooms; when the file gets too much garbage, it has to be rewritten
+     * from scratch with openForWriting() (compacted).
+     *
+     * When the cache is opened for reading, the file is mapped into memory
+     * and the records are accessed in place with QJsonDocument::fromRawData(),
+     * without parsing any text. JSON objects passed to the visitor
+     * in forEachRoom() refer to the mapped memory; they (and anything that
+     * might keep them, such as events) must not outlive the StateCache object.
+     */
+    class StateCache
+    {
+        public:
+            using room_visitor_t = std::function<void(const QString& roomId,
+                JoinState joinState, const QJsonObject& roomState)>;
+
+            static const quint32 FormatVersion;
+
+            explicit StateCache(const QString& fileName);
+            ~StateCache();
+
+            /** Checks whether the file starts with the binary cache signature */
+            static bool isStateCache(const QString& fileName);
+
+            /**
+             * Maps the file into memory and indexes its records
+             *
+             * @return false if the file cannot be read or is not a binary
+             * state cache of a supported version
+             */
+            bool openForReading();
+            /**
+             * Starts a new cache with the header; it is written to
+             * a temporary file, which only replaces the existing cache
+             * upon commit()
+             */
+            bool openForWriting();
+            /**
+             * Opens an existing cache to append records to it
+             *
+             * Only the header is checked, the records are not read.
+             * @return false if the file cannot be opened or is not a binary
+             * state cache of a supported version
+             */
+            bool openForAppending();
+            /**
+             * Makes the records written so far durable; a cache opened with
+             * openForWriting() replaces the old file at this point
+             */
+            bool commit();
+            /** Closes the cache; an uncommitted new cache is discarded */
+            void close();
+
+            QString nextBatch() const;
+            void forEachRoom(const room_visitor_t& visitor) const;
+            /** The number of all records found by openForReading() */
+            int recordCount() const;
+            /** The number of rooms found by openForReading() */
+            int roomCount() const;
+
+            bool writeNextBatch(const QString& nextBatch);
+            bool writeRoom(const QString& roomId, JoinState joinState,
+                           const QJsonObject& roomState);
+            bool writeRoomRemoval(const QString& roomId, JoinState joinState);
+
+            QString errorString() const;
+
+        private:
+            // Same as in Connection::roomMap(): the id and whether it's
+            // an invitation
+            using room_key_t = QPair<QString, bool>;
+
+            QFile file;
+            QSaveFile newFile;
+            // Either of the two above, when writing
+            QFileDevice* out = nullptr;
+            const uchar* data = nullptr;
+            qint64 dataSize = 0;
+            QString lastNextBatch;
+            int records = 0;
+            QHash<room_key_t, qint64> roomRecords;
+
+            bool checkHeader(const uchar* header);
+            QJsonObject recordAt(qint64 offset) const;
+            bool writeRecord(const QJsonObject& record);
+    };
+}  // namespace QMatrixClient
@@ -25,6 +25,7 @@
 #include "jobs/generated/profile.h"
 
 #include <QtCore/QTimer>
+#include <QtCore/QCollator>
 #include <QtCore/QRegularExpression>
 
 using namespace QMatrixClient;
@@ -35,6 +36,7 @@ class User::Private
         Private(QString userId, Connection* connection)
             : userId(std::move(userId)), connection(connection)
             , avatar(connection, QIcon::fromTheme(QStringLiteral("user-available")))
+            , sortKey(makeSortKey(this->userId))
         { }
 
         QString userId;
@@ -42,6 +44,7 @@ class User::Private
         QString bridged;
         Connection* connection;
         Avatar avatar;
+        QCollatorSortKey sortKey;
 };
 
 User::User(QString userId, Connection* connection)
@@ -69,6 +72,7 @@ void User::updateName(const QString& newName)
     if (d->name != newName)
     {
         d->name = newName;
+        d->sortKey = makeSortKey(displayname());
         emit nameChanged(this, oldName);
     }
 }
@@ -90,6 +94,17 @@ QString User::bridged() const {
     return d->bridged;
 }
 
+const QCollatorSortKey& User::sortKey() const
+{
+    return d->sortKey;
+}
+
+QCollatorSortKey User::makeSortKey(const QString& name)
+{
+    static const QCollator collator;
+    return collator.sortKey(name.startsWith('@') ? name.mid(1) : name);
+}
+
 Avatar& User::avatarObject()
 {
     return d->avatar;
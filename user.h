@@ -20,6 +20,7 @@
 
 #include <QtCore/QString>
 #include <QtCore/QObject>
+#include <QtCore/QCollatorSortKey>
 #include "avatar.h"
 
 namespace QMatrixClient
@@ -53,6 +54,19 @@ namespace QMatrixClient
             */
             Q_INVOKABLE QString bridged() const;
 
+            /**
+             * Returns the collation key for displayname(), updated
+             * along with the name; see makeSortKey()
+             */
+            const QCollatorSortKey& sortKey() const;
+            /**
+             * @brief Makes a locale-aware collation key for a user name
+             *
+             * The leading '@' is ignored so that users without a display
+             * name (shown by their ids) don't all end up on top of lists.
+             */
+            static QCollatorSortKey makeSortKey(const QString& name);
+
             Avatar& avatarObject();
             QPixmap avatar(int requestedWidth, int requestedHeight);
 